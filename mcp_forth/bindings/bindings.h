@@ -6,6 +6,7 @@
 #ifdef CONFIG_MCP_APPS_MCPD
 extern const m4_runtime_cb_array_t m4_runtime_lib_mcpd[];
 #define M4_RUNTIME_LIB_ENTRY_MCPD m4_runtime_lib_mcpd,
+void mcp_forth_set_thread_peer_id(int peer_id);
 #else
 #define M4_RUNTIME_LIB_ENTRY_MCPD
 #endif
@@ -37,6 +38,7 @@ extern const m4_runtime_cb_array_t m4_runtime_lib_mcp_lvgl[];
 extern const m4_runtime_cb_array_t m4_runtime_lib_unix[];
 extern const m4_runtime_cb_array_t m4_runtime_lib_malloc[];
 extern const m4_runtime_cb_array_t m4_runtime_lib_mount[];
+extern const m4_runtime_cb_array_t m4_runtime_lib_pixel[];
 
 #define M4_RUNTIME_LIB_MCP_ALL_ENTRIES \
     M4_RUNTIME_LIB_ENTRY_MCPD \
@@ -47,4 +49,5 @@ extern const m4_runtime_cb_array_t m4_runtime_lib_mount[];
     m4_runtime_lib_unix, \
     m4_runtime_lib_malloc, \
     m4_runtime_lib_mount, \
+    m4_runtime_lib_pixel, \
     /* keep this line blank */
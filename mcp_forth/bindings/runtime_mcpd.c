@@ -12,6 +12,34 @@
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+
+/* Drivers that share a process, like under `mcp_forth -d`, each set
+   their peer for their own thread. Otherwise it comes from MCP_PEER. */
+
+static pthread_key_t thread_peer_key;
+static pthread_once_t thread_peer_once = PTHREAD_ONCE_INIT;
+
+static void thread_peer_key_create(void)
+{
+    assert(0 == pthread_key_create(&thread_peer_key, NULL));
+}
+
+void mcp_forth_set_thread_peer_id(int peer_id)
+{
+    assert(0 == pthread_once(&thread_peer_once, thread_peer_key_create));
+    /* stored plus one so that unset reads as NULL */
+    assert(0 == pthread_setspecific(thread_peer_key, (void *)(intptr_t)(peer_id + 1)));
+}
+
+static int get_peer_id(void)
+{
+    assert(0 == pthread_once(&thread_peer_once, thread_peer_key_create));
+    intptr_t thread_peer = (intptr_t) pthread_getspecific(thread_peer_key);
+    if(thread_peer) return thread_peer - 1;
+    char * peer_str = getenv("MCP_PEER");
+    return peer_str != NULL ? atoi(peer_str) : MCPD_ENV_NOT_SET;
+}
 
 static int mcpd_driver_connect(void * param, m4_stack_t * stack)
 {
@@ -20,12 +48,11 @@ static int mcpd_driver_connect(void * param, m4_stack_t * stack)
     stack->len += 2;
 
     int res;
-    char * peer_str = getenv("MCP_PEER");
-    if(peer_str == NULL) {
+    int peer = get_peer_id();
+    if(peer == MCPD_ENV_NOT_SET) {
         stack->data[-1] = MCPD_ENV_NOT_SET;
         return 0;
     }
-    int peer = atoi(peer_str);
     mcpd_con_t con;
     res = mcpd_connect(&con, peer);
     if(res != MCPD_OK) {
@@ -48,8 +75,7 @@ static int mcpd_driver_connect(void * param, m4_stack_t * stack)
 static int mcpd_peer_id(void * param, m4_stack_t * stack)
 {
     if(!(stack->len < stack->max)) return M4_STACK_OVERFLOW_ERROR;
-    char * peer_str = getenv("MCP_PEER");
-    stack->data[0] = peer_str !=  NULL ? atoi(peer_str) : MCPD_ENV_NOT_SET;
+    stack->data[0] = get_peer_id();
     stack->data += 1;
     stack->len += 1;
     return 0;
@@ -59,12 +85,12 @@ static int mcpd_acatpath(void * param, m4_stack_t * stack)
 {
     if(!(stack->len)) return M4_STACK_UNDERFLOW_ERROR;
     char ** strp = (char **) stack->data - 1;
-    char * peer_str = getenv("MCP_PEER");
-    if(peer_str == NULL) {
+    int peer = get_peer_id();
+    if(peer == MCPD_ENV_NOT_SET) {
         *strp = NULL;
         return 0;
     }
-    int res = asprintf(strp, "/mnt/mcp/%d/%s", atoi(peer_str), *strp);
+    int res = asprintf(strp, "/mnt/mcp/%d/%s", peer, *strp);
     assert(res != -1);
     return 0;
 }
@@ -182,6 +208,7 @@ const m4_runtime_cb_array_t m4_runtime_lib_mcpd[] = {
     {"mcpd_resource_get_path", {m4_f12, mcpd_resource_get_path}},
 
     {"mcpd_file_hash", {m4_f13, mcpd_file_hash}},
+    {"mcpd_file_generation", {m4_f14, mcpd_file_generation}},
 
 
     /* resources */
@@ -0,0 +1,118 @@
+#include "bindings.h"
+#include <stdint.h>
+#include <string.h>
+
+/* Pixel conversions for display drivers to run on LVGL flush areas
+   before handing them to the bus. Sources are native endian RGB565 as
+   LVGL renders it. Counts are in pixels. dst and src may be the same
+   buffer for the swap and fill. */
+
+static void pixel_rgb565_swap(uint16_t * dst, const uint16_t * src, int count)
+{
+    int i = 0;
+    /* two pixels at a time when both buffers allow it */
+    if((((uintptr_t) dst | (uintptr_t) src) & 3) == 0) {
+        uint32_t * d32 = (uint32_t *) dst;
+        const uint32_t * s32 = (const uint32_t *) src;
+        for(; i + 1 < count; i += 2) {
+            uint32_t v = *s32++;
+            *d32++ = ((v & 0x00ff00ffu) << 8) | ((v >> 8) & 0x00ff00ffu);
+        }
+    }
+    for(; i < count; i++) {
+        uint16_t v = src[i];
+        dst[i] = (v << 8) | (v >> 8);
+    }
+}
+
+/* 3 bytes per pixel, each channel in the top 6 bits, red first */
+static void pixel_rgb565_to_rgb666(uint8_t * dst, const uint16_t * src, int count)
+{
+    for(int i = 0; i < count; i++) {
+        uint16_t v = src[i];
+        *dst++ = (v >> 8) & 0xf8;
+        *dst++ = (v >> 3) & 0xfc;
+        *dst++ = v << 3;
+    }
+}
+
+static inline bool rgb565_is_on(uint16_t v, int threshold)
+{
+    int r = (v >> 8) & 0xf8;
+    int g = (v >> 3) & 0xfc;
+    int b = (v << 3) & 0xf8;
+    return ((r * 77 + g * 150 + b * 29) >> 8) >= threshold;
+}
+
+/* rows of (width + 7) / 8 bytes, leftmost pixel in the top bit. A pixel
+   is set if its luma is at least `threshold` (0-255). */
+static void pixel_rgb565_to_1bpp(uint8_t * dst, const uint16_t * src,
+                                 int width, int height, int threshold)
+{
+    int row_bytes = (width + 7) / 8;
+    memset(dst, 0, row_bytes * height);
+    for(int y = 0; y < height; y++) {
+        uint8_t * row = dst + y * row_bytes;
+        for(int x = 0; x < width; x++) {
+            if(rgb565_is_on(*src++, threshold)) {
+                row[x >> 3] |= 0x80 >> (x & 7);
+            }
+        }
+    }
+}
+
+/* pages of 8 rows, one byte per column with the top row in the low bit,
+   the SSD1306 layout */
+static void pixel_rgb565_to_1bpp_paged(uint8_t * dst, const uint16_t * src,
+                                       int width, int height, int threshold)
+{
+    memset(dst, 0, width * ((height + 7) / 8));
+    for(int y = 0; y < height; y++) {
+        uint8_t * page = dst + (y >> 3) * width;
+        uint8_t bit = 1 << (y & 7);
+        for(int x = 0; x < width; x++) {
+            if(rgb565_is_on(*src++, threshold)) {
+                page[x] |= bit;
+            }
+        }
+    }
+}
+
+/* `rows` rows of `row_bytes` from a packed source into a buffer whose
+   rows are `dst_stride` bytes apart, like a flush area into a frame */
+static void pixel_area_copy(uint8_t * dst, int dst_stride, const uint8_t * src,
+                            int row_bytes, int rows)
+{
+    for(int y = 0; y < rows; y++) {
+        memcpy(dst, src, row_bytes);
+        dst += dst_stride;
+        src += row_bytes;
+    }
+}
+
+/* `value` is stored as is, swap it first for a big endian panel */
+static void pixel_fill16(uint16_t * dst, int value, int count)
+{
+    int i = 0;
+    if(((uintptr_t) dst & 3) == 0) {
+        uint32_t v32 = ((uint32_t) (uint16_t) value << 16) | (uint16_t) value;
+        uint32_t * d32 = (uint32_t *) dst;
+        for(; i + 1 < count; i += 2) {
+            *d32++ = v32;
+        }
+    }
+    for(; i < count; i++) {
+        dst[i] = value;
+    }
+}
+
+const m4_runtime_cb_array_t m4_runtime_lib_pixel[] = {
+    {"pixel_rgb565_swap", {m4_f03, pixel_rgb565_swap}},
+    {"pixel_rgb565_to_rgb666", {m4_f03, pixel_rgb565_to_rgb666}},
+    {"pixel_rgb565_to_1bpp", {m4_f05, pixel_rgb565_to_1bpp}},
+    {"pixel_rgb565_to_1bpp_paged", {m4_f05, pixel_rgb565_to_1bpp_paged}},
+    {"pixel_area_copy", {m4_f05, pixel_area_copy}},
+    {"pixel_fill16", {m4_f03, pixel_fill16}},
+
+    {NULL}
+};
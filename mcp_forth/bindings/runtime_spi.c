@@ -3,6 +3,234 @@
 #ifdef CONFIG_SPI_DRIVER
 #include <nuttx/spi/spi_transfer.h>
 #include <stddef.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+
+/* A batch is a reusable SPI sequence with room for `max_trans`
+   transfers and `max_bytes` bytes of its own for command bytes and
+   fill patterns. Transfers are added, the batch is submitted with one
+   SPIIOC_TRANSFER per 255 transfers (spi_sequence_s.ntrans is 8 bits),
+   and it can be submitted again or reset and refilled. Lengths are in
+   bytes whatever the word size. Buffers passed to tx and txrx must stay
+   valid until the last submit. A batch that ran out of room fails to
+   submit with ENOBUFS until it is reset. */
+
+#define SEQ_NTRANS_MAX 255
+
+typedef struct {
+    int fd;
+    struct spi_sequence_s seq;
+    int word_shift;
+    int max_trans;
+    int ntrans;
+    int max_bytes;
+    int nbytes;
+    int byte_run; /* the transfer spi_batch_byte extends, -1 if none */
+    bool overflow;
+    uint32_t * lens;
+    uint8_t * bytes;
+    struct spi_trans_s trans[];
+} spi_batch_t;
+
+static spi_batch_t * spi_batch_create(int fd, int max_trans, int max_bytes)
+{
+    if(max_trans <= 0 || max_bytes < 0) return NULL;
+
+    spi_batch_t * b = malloc(sizeof(*b)
+                             + max_trans * (sizeof(struct spi_trans_s) + sizeof(uint32_t))
+                             + max_bytes);
+    if(b == NULL) return NULL;
+
+    memset(b, 0, sizeof(*b));
+    b->fd = fd;
+    b->seq.nbits = 8;
+    b->seq.frequency = 1000000;
+    b->max_trans = max_trans;
+    b->max_bytes = max_bytes;
+    b->byte_run = -1;
+    b->lens = (uint32_t *) &b->trans[max_trans];
+    b->bytes = (uint8_t *) &b->lens[max_trans];
+    return b;
+}
+
+static void spi_batch_destroy(spi_batch_t * b)
+{
+    free(b);
+}
+
+static void spi_batch_config(spi_batch_t * b, int dev, int mode, int nbits, int frequency)
+{
+    b->seq.dev = dev;
+    b->seq.mode = mode;
+    b->seq.nbits = nbits;
+    b->seq.frequency = frequency;
+    b->word_shift = nbits > 16 ? 2 : nbits > 8 ? 1 : 0;
+}
+
+static void spi_batch_reset(spi_batch_t * b)
+{
+    b->ntrans = 0;
+    b->nbytes = 0;
+    b->byte_run = -1;
+    b->overflow = false;
+}
+
+static struct spi_trans_s * trans_add(spi_batch_t * b, const void * tx, void * rx, uint32_t len)
+{
+    b->byte_run = -1;
+    if(b->ntrans == b->max_trans) {
+        b->overflow = true;
+        return NULL;
+    }
+    b->lens[b->ntrans] = len;
+    struct spi_trans_s * t = &b->trans[b->ntrans++];
+    memset(t, 0, sizeof(*t));
+    t->txbuffer = tx;
+    t->rxbuffer = rx;
+    return t;
+}
+
+static void spi_batch_tx(spi_batch_t * b, const void * buf, int len)
+{
+    trans_add(b, buf, NULL, len);
+}
+
+static void spi_batch_txrx(spi_batch_t * b, const void * txbuf, void * rxbuf, int len)
+{
+    trans_add(b, txbuf, rxbuf, len);
+}
+
+/* consecutive bytes go out as one transfer */
+static void spi_batch_byte(spi_batch_t * b, int byte)
+{
+    if(b->nbytes == b->max_bytes) {
+        b->overflow = true;
+        return;
+    }
+    uint8_t * p = &b->bytes[b->nbytes++];
+    *p = byte;
+
+    if(b->byte_run >= 0) {
+        b->lens[b->byte_run]++;
+        return;
+    }
+    if(trans_add(b, p, NULL, 1)) {
+        b->byte_run = b->ntrans - 1;
+    }
+}
+
+#ifdef CONFIG_SPI_CMDDATA
+/* a command byte is a transfer of its own with the command line set */
+static void spi_batch_cmd(spi_batch_t * b, int byte)
+{
+    spi_batch_byte(b, byte);
+    if(b->byte_run >= 0) {
+        b->trans[b->byte_run].cmd = true;
+    }
+    b->byte_run = -1;
+}
+#endif
+
+#define FILL_PATTERN_MIN 64
+
+/* `count` repetitions of the `value_len` byte `value`, like a run of
+   one RGB565 color. `value` goes out most significant byte first, so
+   with words wider than 8 bits it's split into words, each stored in
+   the CPU's order the way the driver sends them, and `value_len` has
+   to be a multiple of the word size. The pattern is laid out once in
+   half of the batch's spare bytes, but no less than FILL_PATTERN_MIN,
+   and sent as many times as needed, so a big fill is a few long
+   transfers and the other half is left for later commands and fills.
+   Any other `value_len` or a `count` below 1 fails the submit. */
+static void spi_batch_fill(spi_batch_t * b, int value, int value_len, int count)
+{
+    int word_len = 1 << b->word_shift;
+    if(value_len < 1 || value_len > 4 || value_len % word_len || count <= 0) {
+        b->overflow = true;
+        return;
+    }
+
+    /* the words of the pattern are aligned for the driver */
+    int start = (b->nbytes + word_len - 1) & ~(word_len - 1);
+    uint32_t room = start < b->max_bytes ? b->max_bytes - start : 0;
+
+    uint32_t total = (uint32_t) value_len * count;
+    uint32_t chunk = room / 2;
+    if(chunk < FILL_PATTERN_MIN) chunk = FILL_PATTERN_MIN + value_len - 1;
+    if(chunk > total) chunk = total;
+    if(chunk > room) chunk = room;
+    chunk -= chunk % value_len;
+    if(chunk == 0) {
+        b->overflow = true;
+        return;
+    }
+
+    uint8_t * p = &b->bytes[start];
+    b->nbytes = start + chunk;
+    for(int j = 0; j < value_len; j += word_len) {
+        uint32_t word = (uint32_t) value >> ((value_len - word_len - j) * 8);
+        if(word_len == 1) {
+            p[j] = word;
+        }
+        else if(word_len == 2) {
+            uint16_t word16 = word;
+            memcpy(&p[j], &word16, 2);
+        }
+        else {
+            memcpy(&p[j], &word, 4);
+        }
+    }
+    for(uint32_t i = value_len; i < chunk; i += value_len) {
+        memcpy(&p[i], p, value_len);
+    }
+
+    while(total) {
+        uint32_t len = total < chunk ? total : chunk;
+        if(!trans_add(b, p, NULL, len)) return;
+        total -= len;
+    }
+}
+
+static void spi_batch_deselect(spi_batch_t * b)
+{
+    if(b->ntrans) {
+        b->trans[b->ntrans - 1].deselect = true;
+    }
+    b->byte_run = -1;
+}
+
+static void spi_batch_delay(spi_batch_t * b, int us)
+{
+    if(b->ntrans) {
+        b->trans[b->ntrans - 1].delay = us;
+    }
+    b->byte_run = -1;
+}
+
+static int spi_batch_submit(spi_batch_t * b)
+{
+    if(b->overflow) {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    for(int i = 0; i < b->ntrans; i++) {
+        b->trans[i].nwords = b->lens[i] >> b->word_shift;
+    }
+
+    for(int i = 0; i < b->ntrans; i += SEQ_NTRANS_MAX) {
+        int n = b->ntrans - i;
+        b->seq.ntrans = n < SEQ_NTRANS_MAX ? n : SEQ_NTRANS_MAX;
+        b->seq.trans = &b->trans[i];
+        int res = ioctl(b->fd, SPIIOC_TRANSFER, (unsigned long)(uintptr_t) &b->seq);
+        if(res < 0) return res;
+    }
+
+    return 0;
+}
 
 const m4_runtime_cb_array_t m4_runtime_lib_spi[] = {
     {"spiioc_transfer", {m4_lit, (void *) (SPIIOC_TRANSFER)}},
@@ -18,6 +246,21 @@ const m4_runtime_cb_array_t m4_runtime_lib_spi[] = {
     {"spi_sequence_s.ntrans", {m4_lit, (void *) offsetof(struct spi_sequence_s, ntrans)}},
     {"spi_sequence_s.trans", {m4_lit, (void *) offsetof(struct spi_sequence_s, trans)}},
 
+    {"spi_batch_create", {m4_f13, spi_batch_create}},
+    {"spi_batch_destroy", {m4_f01, spi_batch_destroy}},
+    {"spi_batch_config", {m4_f05, spi_batch_config}},
+    {"spi_batch_reset", {m4_f01, spi_batch_reset}},
+    {"spi_batch_tx", {m4_f03, spi_batch_tx}},
+    {"spi_batch_txrx", {m4_f04, spi_batch_txrx}},
+    {"spi_batch_byte", {m4_f02, spi_batch_byte}},
+#ifdef CONFIG_SPI_CMDDATA
+    {"spi_batch_cmd", {m4_f02, spi_batch_cmd}},
+#endif
+    {"spi_batch_fill", {m4_f04, spi_batch_fill}},
+    {"spi_batch_deselect", {m4_f01, spi_batch_deselect}},
+    {"spi_batch_delay", {m4_f02, spi_batch_delay}},
+    {"spi_batch_submit", {m4_f11, spi_batch_submit}},
+
     {NULL}
 };
 
@@ -3,6 +3,8 @@
 #include "../../mcp_forth/mcp_forth.h"
 #include "../../bindings/bindings.h"
 
+#include <stdio.h>
+
 #define mcp_forth_global_cleanup m4_global_cleanup
 
 typedef enum {
@@ -10,12 +12,27 @@ typedef enum {
     MCP_FORTH_ERROR_PATH_OPEN,
     MCP_FORTH_ERROR_COMPILE,
     MCP_FORTH_ERROR_RUNTIME,
+    MCP_FORTH_ERROR_MEMORY,
 } mcp_forth_error_t;
 
+typedef struct mcp_forth_arena_s mcp_forth_arena_t;
+typedef struct mcp_forth_profile_s mcp_forth_profile_t;
+
 typedef struct {
     uint8_t * bin;
     void * dl_handle;
-    unsigned dl_number;
+    mcp_forth_arena_t * arena;
+    mcp_forth_profile_t * profile;
+    int bin_len; /* compiled size */
+    uint32_t compile_us; /* 0 if a compiled image was loaded */
+    uint32_t run_us; /* until the program's top level returned */
+    /* what mcp_forth_run needs, set by mcp_forth_load_path */
+    m4_engine_run_t run_func;
+    uint8_t * cont;
+    uint8_t * code;
+    uint8_t * memory;
+    int memory_len;
+    const m4_runtime_cb_array_t * const * runtime_cbs;
 } mcp_forth_load_t;
 
 typedef struct {
@@ -23,8 +40,29 @@ typedef struct {
     int m4_error_val;
     int compile_error_near;
     const char * missing_runtime_word;
+    int memory_len;
 } mcp_forth_error_info_t;
 
+/* Pass a NULL `memory` to have the program's memory allocated from the
+   shared arena pool. Its size is declared by a line comment at the top
+   of the source, `\ mcp_forth memory <bytes>`, and defaults to
+   CONFIG_MCP_APPS_MCP_FORTH_MEMORY_DEFAULT. `memory_len` is ignored.
+   The arena is in `load_dst->arena` and is released by unload.
+   If MCP_FORTH_PROFILE is set in the environment the program is
+   profiled and the reports are written into that directory.
+   mcp_forth_load_path compiles the program without running it and
+   mcp_forth_run runs it, so a host can compile in the background and
+   run the program on the thread it belongs on. Either way the load is
+   released with mcp_forth_unload, even if it failed. */
+
+mcp_forth_error_t mcp_forth_load_path(mcp_forth_load_t * load_dst, const char * path,
+                                      uint8_t * memory, int memory_len,
+                                      const m4_runtime_cb_array_t * const * runtime_cbs,
+                                      bool native,
+                                      mcp_forth_error_info_t * error_dst);
+
+mcp_forth_error_t mcp_forth_run(mcp_forth_load_t * load, mcp_forth_error_info_t * error_dst);
+
 mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const char * path,
                                               uint8_t * memory, int memory_len,
                                               const m4_runtime_cb_array_t * const * runtime_cbs,
@@ -34,3 +72,19 @@ mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const
 void mcp_forth_log_error(mcp_forth_error_t load_res, const mcp_forth_error_info_t * load_error);
 
 void mcp_forth_unload(mcp_forth_load_t * load);
+
+mcp_forth_arena_t * mcp_forth_arena_alloc(int len, const char * name);
+void mcp_forth_arena_free(mcp_forth_arena_t * arena);
+uint8_t * mcp_forth_arena_memory(const mcp_forth_arena_t * arena, int * len_dst);
+int mcp_forth_arena_high_water(const mcp_forth_arena_t * arena);
+void mcp_forth_arena_print_stats(FILE * f);
+
+mcp_forth_profile_t * mcp_forth_profile_create(const char * out_dir, const char * program_path,
+                                               const m4_runtime_cb_array_t * const * runtime_cbs);
+const m4_runtime_cb_array_t * const * mcp_forth_profile_runtime_cbs(const mcp_forth_profile_t * prof);
+/* Bracket a host's calls into the program so the time the program
+   spends in its own words there is counted. mcp_forth_run does it for
+   the top level. They nest. */
+void mcp_forth_profile_enter(mcp_forth_profile_t * prof);
+void mcp_forth_profile_leave(mcp_forth_profile_t * prof);
+void mcp_forth_profile_destroy(mcp_forth_profile_t * prof);
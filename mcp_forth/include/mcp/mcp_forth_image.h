@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/* A compiled program saved so a later load of the same source can skip
+   m4_compile. The file is this header followed by `bin_len` bytes of
+   compiler output, all little endian. An image is only used if it was
+   compiled from the same source, by its SHA-256, for the loader's
+   backend by the same build of the compiler.
+   MCP_FORTH_BUILD_ID, generated by the Makefile into
+   mcp_forth_build_id.h, hashes the compiler and backend sources and
+   generator options so it changes whenever their output can. Bump
+   MCP_FORTH_IMAGE_VERSION when this header changes. The runtime words
+   and the memory size are not part of it because m4_compile doesn't
+   see them; words are bound by name when the program starts.
+   Images come from the loader's own cache (.m4c) or are compiled ahead
+   of time by the host tool mcp_forth_aot and shipped by a module next
+   to the source as <source>.<backend name>.m4i. */
+
+#define MCP_FORTH_IMAGE_MAGIC 0x6334346du /* "m44c" */
+#define MCP_FORTH_IMAGE_VERSION 4
+
+#define MCP_FORTH_IMAGE_BACKEND_VM      0
+#define MCP_FORTH_IMAGE_BACKEND_X86_32  1
+#define MCP_FORTH_IMAGE_BACKEND_ESP32S3 2
+
+#define MCP_FORTH_IMAGE_BACKEND_NAMES {"vm", "x86-32", "esp32s3"}
+
+#define MCP_FORTH_IMAGE_SUFFIX ".m4c"
+#define MCP_FORTH_IMAGE_PAYLOAD_SUFFIX ".m4i"
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t backend;
+    uint8_t reserved;
+    uint32_t build_id; /* MCP_FORTH_BUILD_ID of the compiler */
+    uint8_t source_sha256[32];
+    uint32_t declared_memory_len; /* from the source, 0 if it has none */
+    int32_t code_offset;
+    uint32_t bin_len;
+} mcp_forth_image_header_t;
+
+#define MCP_FORTH_MEMORY_DIRECTIVE "\\ mcp_forth memory "
+
+/* `\ mcp_forth memory <bytes>` among the comment lines at the top of
+   the source. Returns 0 if there is none. */
+static inline int mcp_forth_source_declared_memory_len(const char * buf, size_t len)
+{
+    const size_t directive_len = sizeof(MCP_FORTH_MEMORY_DIRECTIVE) - 1;
+    const char * end = buf + len;
+    const char * line = buf;
+    while(line < end) {
+        const char * eol = memchr(line, '\n', end - line);
+        if(eol == NULL) eol = end;
+        size_t line_len = eol - line;
+        if(line_len && line[0] != '\\' && line[0] != '\r') break;
+        if(line_len > directive_len
+           && 0 == memcmp(line, MCP_FORTH_MEMORY_DIRECTIVE, directive_len)) {
+            int val = 0;
+            for(const char * c = line + directive_len;
+                c < eol && *c >= '0' && *c <= '9' && val < 0x1000000; c++) {
+                val = val * 10 + (*c - '0');
+            }
+            return val;
+        }
+        line = eol + 1;
+    }
+    return 0;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <mqueue.h>
+
+/* Hands drivers to a resident `mcp_forth -d` to run. */
+
+#define MCP_FORTH_QUEUE_PATH_MAX 64
+
+typedef mqd_t mcp_forth_queue_t;
+
+typedef struct {
+    int peer_id;
+    char path[MCP_FORTH_QUEUE_PATH_MAX];
+} mcp_forth_queue_msg_t;
+
+mcp_forth_queue_t mcp_forth_queue_open(void);
+void mcp_forth_queue_send(mcp_forth_queue_t mq, int peer_id, const char * path);
+void mcp_forth_queue_close(mcp_forth_queue_t mq);
@@ -1,4 +1,6 @@
 #include <mcp/mcp_forth.h>
+#include <mcp/mcp_forth_image.h>
+#include "mcp_forth_build_id.h"
 
 #include <nuttx/config.h>
 
@@ -8,16 +10,31 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
-#include <semaphore.h>
+#include <sys/mman.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <time.h>
 #include <sys/boardctl.h>
 #include <sys/mount.h>
+#include <stdatomic.h>
 
 #ifdef CONFIG_MCP_APPS_MCP_FS
     #include <mcp/mcp_fs.h>
 #endif
 
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_DAEMON
+    #include <mcp/mcp_forth_queue.h>
+    #include <pthread.h>
+#endif
+
+#if defined(CONFIG_MCP_APPS_MCP_FORTH_IMAGE_CACHE) || defined(CONFIG_MCP_APPS_MCP_FORTH_PRECOMPILED)
+    #define HAVE_IMAGE
+#endif
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_IMAGE_CACHE
+    #include <inttypes.h>
+#endif
+
 #define STRINGIFY_(x) #x
 #define STRINGIFY(x) STRINGIFY_(x)
 
@@ -26,31 +43,216 @@
     #define NATIVE_ARCH     M4_ARCH_X86_32
     #define NATIVE_BACKEND  m4_x86_32_backend
     #define NATIVE_RUN_FUNC m4_x86_32_engine_run
+    #define NATIVE_IMAGE_ID MCP_FORTH_IMAGE_BACKEND_X86_32
 #elif defined(CONFIG_MCP_APPS_MCP_FORTH_NATIVE_ESP32S3)
     #define NATIVE_ARCH     M4_ARCH_ESP32S3
     #define NATIVE_BACKEND  m4_esp32s3_backend
     #define NATIVE_RUN_FUNC m4_esp32s3_engine_run
+    #define NATIVE_IMAGE_ID MCP_FORTH_IMAGE_BACKEND_ESP32S3
 #else
     #undef HAVE_NATIVE
 #endif
 
-#define MEMORY_SIZE 2048
-
 #ifdef HAVE_NATIVE
     #define DL_PATH "/tmp/"
     #define DL_PREFIX "m4_dl_"
-    #define DL_PATH_MAX (sizeof(DL_PATH DL_PREFIX) + 10)
-    #define DL_CTR_NAME "m4_dl_ctr"
+    #define DL_PATH_MAX (sizeof(DL_PATH DL_PREFIX) + 22)
 #endif
 
-mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const char * path,
-                                              uint8_t * memory, int memory_len,
-                                              const m4_runtime_cb_array_t * const * runtime_cbs,
-                                              bool native,
-                                              mcp_forth_error_info_t * error_dst)
+#if defined(HAVE_NATIVE) || defined(CONFIG_MCP_APPS_MCP_FORTH_IMAGE_CACHE)
+/* with the pid, makes the names of files this process creates unique */
+static atomic_uint unique_counter;
+#endif
+
+#ifdef HAVE_IMAGE
+    #define IMAGE_PATH_MAX 128
+    #define IMAGE_TMP_SUFFIX_MAX 26 /* ".<pid>_<counter>.tmp" */
+#endif
+
+#ifdef HAVE_IMAGE
+static const char * const image_backend_names[] = MCP_FORTH_IMAGE_BACKEND_NAMES;
+
+static int image_backend(bool native)
+{
+#ifdef HAVE_NATIVE
+    if(native) {
+        return NATIVE_IMAGE_ID;
+    }
+#endif
+    return MCP_FORTH_IMAGE_BACKEND_VM;
+}
+
+/* The source's hash, from the name of its mcp_fs cache entry. That's
+   the only place it is known without hashing the source again, so
+   only sources in the cache can have images. */
+static bool image_source_hash(uint8_t * dst, const char * cachepath)
+{
+    const char * hex = strrchr(cachepath, '/') + 1;
+    for(int i = 0; i < 32; i++) {
+        unsigned byte;
+        if(1 != sscanf(hex + i * 2, "%2x", &byte)) return false;
+        dst[i] = byte;
+    }
+    return true;
+}
+
+/* returns the compiled program or NULL if there is no matching image */
+static uint8_t * image_load(const char * image_path, const mcp_forth_image_header_t * want,
+                            int * bin_len_dst, int * code_offset_dst,
+                            int * declared_memory_len_dst)
+{
+    ssize_t rwres;
+    struct stat st;
+    mcp_forth_image_header_t hdr;
+
+    int fd = open(image_path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    uint8_t * bin = NULL;
+    rwres = read(fd, &hdr, sizeof(hdr));
+    if(rwres != sizeof(hdr)
+       || hdr.magic != want->magic
+       || hdr.version != want->version
+       || hdr.backend != want->backend
+       || hdr.build_id != want->build_id
+       || 0 != memcmp(hdr.source_sha256, want->source_sha256, sizeof(hdr.source_sha256))
+       || hdr.bin_len == 0
+       || hdr.code_offset < 0
+       || (uint32_t) hdr.code_offset > hdr.bin_len
+       || hdr.declared_memory_len > CONFIG_MCP_APPS_MCP_FORTH_MEMORY_MAX
+       || 0 != fstat(fd, &st)
+       || st.st_size != sizeof(hdr) + hdr.bin_len) {
+        goto close_ret;
+    }
+
+    bin = malloc(hdr.bin_len);
+    assert(bin);
+    rwres = read(fd, bin, hdr.bin_len);
+    if(rwres != hdr.bin_len) {
+        free(bin);
+        bin = NULL;
+        goto close_ret;
+    }
+
+    *bin_len_dst = hdr.bin_len;
+    *code_offset_dst = hdr.code_offset;
+    *declared_memory_len_dst = hdr.declared_memory_len;
+
+close_ret:
+    assert(0 == close(fd));
+    return bin;
+}
+#endif
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_IMAGE_CACHE
+/* Compiled programs are kept next to the mcp_fs cache entry of their
+   source as /data/<sha256>.<backend>.<build id>.m4c so they share
+   its content addressing and LRU budget. Images of an older compiler
+   are never loaded again and age out of the cache. A source that isn't
+   in the mcp_fs cache is always compiled. */
+
+static void image_path_make(char * dst, const char * cachepath, bool native)
+{
+    int res = snprintf(dst, IMAGE_PATH_MAX, "%s.%s.%08" PRIx32 MCP_FORTH_IMAGE_SUFFIX,
+                       cachepath, image_backend_names[image_backend(native)],
+                       (uint32_t) MCP_FORTH_BUILD_ID);
+    assert(res > 0 && res + IMAGE_TMP_SUFFIX_MAX < IMAGE_PATH_MAX);
+}
+
+static void image_store(const char * image_path, const mcp_forth_image_header_t * hdr_template,
+                        const uint8_t * bin, int bin_len, int code_offset,
+                        int declared_memory_len)
 {
     int res;
     ssize_t rwres;
+
+    mcp_forth_image_header_t hdr = *hdr_template;
+    hdr.code_offset = code_offset;
+    hdr.bin_len = bin_len;
+    hdr.declared_memory_len = declared_memory_len;
+
+    /* A name of its own so a leftover or concurrent writer can't get in
+       the way. mcp_fs removes it at reconcile if it's left behind, and
+       if that happens mid write, the rename just fails. */
+    char tmppath[IMAGE_PATH_MAX];
+    res = snprintf(tmppath, sizeof(tmppath), "%s.%d_%u.tmp", image_path, (int) getpid(),
+                   atomic_fetch_add(&unique_counter, 1));
+    assert(res > 0 && res < sizeof(tmppath));
+
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) return;
+
+    bool ok = true;
+    rwres = write(fd, &hdr, sizeof(hdr));
+    ok = ok && rwres == sizeof(hdr);
+    rwres = write(fd, bin, bin_len);
+    ok = ok && rwres == bin_len;
+    res = close(fd);
+    ok = ok && res == 0;
+
+    if(!ok || 0 != rename(tmppath, image_path)) {
+        unlink(tmppath);
+        return;
+    }
+    mcp_fs_cache_touch(image_path);
+}
+#endif
+
+static uint32_t now_us(void)
+{
+    struct timespec ts;
+    assert(0 == clock_gettime(CLOCK_MONOTONIC, &ts));
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* The source is mapped in place where the file system allows it, like
+   the romfs samples, so only the compiler's output needs the heap.
+   Otherwise it is read in, in as many reads as the file system needs. */
+static char * source_get(int fd, size_t len, bool * mapped_dst)
+{
+    ssize_t rwres;
+
+    if(len) {
+        void * map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED) {
+            *mapped_dst = true;
+            return map;
+        }
+    }
+
+    *mapped_dst = false;
+    char * buf = malloc(len);
+    assert(buf);
+    size_t total = 0;
+    while(total < len) {
+        rwres = read(fd, buf + total, len - total);
+        if(rwres <= 0) {
+            if(rwres == 0) errno = EIO; /* it shrank */
+            free(buf);
+            return NULL;
+        }
+        total += rwres;
+    }
+    return buf;
+}
+
+static void source_put(char * buf, size_t len, bool mapped)
+{
+    if(mapped) {
+        assert(0 == munmap(buf, len));
+    }
+    else {
+        free(buf);
+    }
+}
+
+mcp_forth_error_t mcp_forth_load_path(mcp_forth_load_t * load_dst, const char * path,
+                                      uint8_t * memory, int memory_len,
+                                      const m4_runtime_cb_array_t * const * runtime_cbs,
+                                      bool native,
+                                      mcp_forth_error_info_t * error_dst)
+{
+    int res;
     int errno_save;
     int fd;
     struct stat st;
@@ -58,6 +260,13 @@ mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const
 
     memset(load_dst, 0, sizeof(*load_dst));
 
+    const char * name = path;
+    bool use_arena = memory == NULL;
+    if(use_arena) {
+        memory_len = 0;
+    }
+    int declared_memory_len = 0;
+
     if(error_dst) {
         memset(error_dst, 0, sizeof(*error_dst));
     }
@@ -65,98 +274,169 @@ mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const
         error_dst = &dummy_error_dst;
     }
 
+    const m4_backend_t * backend = &m4_compact_bytecode_vm_backend;
+#ifdef HAVE_NATIVE
+    if(native) {
+        backend = &NATIVE_BACKEND;
+    }
+#endif
+
+    uint8_t * bin = NULL;
+    int code_offset;
+    int bin_len;
+
+    /* the mcp_fs cache entry is opened right away so it can't be
+       evicted before the source is read */
+    fd = -1;
 #ifdef CONFIG_MCP_APPS_MCP_FS
-    char * cachepath = mcp_fs_cache_file(path);
-    if(cachepath) {
-        path = cachepath;
+    char * cachepath;
+    fd = mcp_fs_cache_open(path, &cachepath);
+#endif
+
+#ifdef HAVE_IMAGE
+    mcp_forth_image_header_t image_hdr;
+    memset(&image_hdr, 0, sizeof(image_hdr));
+    image_hdr.magic = MCP_FORTH_IMAGE_MAGIC;
+    image_hdr.version = MCP_FORTH_IMAGE_VERSION;
+    image_hdr.backend = image_backend(native);
+    image_hdr.build_id = MCP_FORTH_BUILD_ID;
+    bool have_source_hash = cachepath && image_source_hash(image_hdr.source_sha256, cachepath);
+#endif
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_IMAGE_CACHE
+    char image_path[IMAGE_PATH_MAX];
+    bool image_is_cached = false;
+    if(have_source_hash) {
+        image_path_make(image_path, cachepath, native);
+        bin = image_load(image_path, &image_hdr, &bin_len, &code_offset,
+                         &declared_memory_len);
+        if(bin) {
+            image_is_cached = true;
+            mcp_fs_cache_touch(image_path);
+        }
     }
 #endif
 
-    fd = open(path, O_RDONLY);
-    errno_save = errno;
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_PRECOMPILED
+    /* an image the module ships, made by mcp_forth_aot. One left behind
+       by an edit of the source has the old source's hash. */
+    if(bin == NULL && have_source_hash) {
+        char payload_path[IMAGE_PATH_MAX];
+        res = snprintf(payload_path, sizeof(payload_path), "%s.%s" MCP_FORTH_IMAGE_PAYLOAD_SUFFIX,
+                       name, image_backend_names[image_hdr.backend]);
+        if(res > 0 && res < sizeof(payload_path)) {
+            bin = image_load(payload_path, &image_hdr, &bin_len, &code_offset,
+                             &declared_memory_len);
+        }
+    }
+#endif
+
+    if(bin && fd >= 0) {
+        res = close(fd);
+        assert(res == 0);
+        fd = -1;
+    }
+    if(bin == NULL && fd < 0) {
+        fd = open(path, O_RDONLY);
+        errno_save = errno;
+    }
 
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_IMAGE_CACHE
+    /* a shipped image is kept too so it isn't fetched again */
+    bool store_image = have_source_hash && !image_is_cached;
+#endif
 #ifdef CONFIG_MCP_APPS_MCP_FS
     free(cachepath);
 #endif
 
-    if(fd < 0) {
-        error_dst->open_errno_val = errno_save;
-        return MCP_FORTH_ERROR_PATH_OPEN;
-    }
+    if(bin == NULL) {
+        if(fd < 0) {
+            error_dst->open_errno_val = errno_save;
+            return MCP_FORTH_ERROR_PATH_OPEN;
+        }
 
-    res = fstat(fd, &st);
-    assert(res == 0);
-    ssize_t buf_len = st.st_size;
-    assert(buf_len >= 0);
+        res = fstat(fd, &st);
+        assert(res == 0);
+        ssize_t buf_len = st.st_size;
+        assert(buf_len >= 0);
 
-    char * buf = malloc(buf_len);
-    assert(buf);
-    rwres = read(fd, buf, buf_len);
-    assert(rwres == buf_len);
+        bool buf_is_mapped;
+        char * buf = source_get(fd, buf_len, &buf_is_mapped);
+        errno_save = errno;
 
-    res = close(fd);
-    assert(res == 0);
+        /* a mapping stays valid after the close */
+        res = close(fd);
+        assert(res == 0);
 
-    const m4_backend_t * backend = &m4_compact_bytecode_vm_backend;
-#ifdef HAVE_NATIVE
-    if(native) {
-        backend = &NATIVE_BACKEND;
+        if(buf == NULL) {
+            error_dst->open_errno_val = errno_save;
+            return MCP_FORTH_ERROR_PATH_OPEN;
+        }
+
+        declared_memory_len = mcp_forth_source_declared_memory_len(buf, buf_len);
+
+        uint32_t t = now_us();
+        bin_len = m4_compile(buf, buf_len, &bin, &code_offset,
+            backend, &error_dst->compile_error_near);
+        load_dst->compile_us = now_us() - t;
+        source_put(buf, buf_len, buf_is_mapped);
+        if(bin_len < 0) {
+            error_dst->m4_error_val = bin_len;
+            return MCP_FORTH_ERROR_COMPILE;
+        }
+    }
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_IMAGE_CACHE
+    if(store_image) {
+        image_store(image_path, &image_hdr, bin, bin_len, code_offset,
+                    declared_memory_len);
     }
 #endif
 
-    uint8_t * bin;
-    int code_offset;
-    int bin_len = m4_compile(buf, buf_len, &bin, &code_offset,
-        backend, &error_dst->compile_error_near);
-    free(buf);
-    if(bin_len < 0) {
-        error_dst->m4_error_val = bin_len;
-        return MCP_FORTH_ERROR_COMPILE;
+    if(use_arena) {
+        int want_len = declared_memory_len ? declared_memory_len
+                                           : CONFIG_MCP_APPS_MCP_FORTH_MEMORY_DEFAULT;
+        load_dst->arena = mcp_forth_arena_alloc(want_len, name);
+        if(load_dst->arena == NULL) {
+            load_dst->bin = bin;
+            error_dst->memory_len = want_len;
+            return MCP_FORTH_ERROR_MEMORY;
+        }
+        memory = mcp_forth_arena_memory(load_dst->arena, &memory_len);
     }
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_PROFILE
+    const char * profile_dir = getenv("MCP_FORTH_PROFILE");
+    if(profile_dir) {
+        load_dst->profile = mcp_forth_profile_create(profile_dir, name, runtime_cbs);
+        runtime_cbs = mcp_forth_profile_runtime_cbs(load_dst->profile);
+    }
+#endif
+
     uint8_t * code = NULL;
 
     m4_engine_run_t run_func = m4_vm_engine_run;
     load_dst->bin = bin;
 #ifdef HAVE_NATIVE
     if(native) {
+        ssize_t rwres;
+
         run_func = NATIVE_RUN_FUNC;
         load_dst->bin = NULL;
 
+        /* The ELF only has to exist until dlopen has read it in, but the
+           module loader keeps its name for as long as it is loaded and
+           refuses a name that is already in use, so every load gets a
+           name of its own, without a lock. */
         char dl_path[DL_PATH_MAX];
-
-        sem_t * sem = sem_open(DL_CTR_NAME, O_CREAT, 0666, 1);
-        assert(sem != SEM_FAILED);
-        res = sem_wait(sem);
-        assert(res == 0);
-
-        fd = open(DL_PATH DL_CTR_NAME, O_CREAT | O_RDWR, 0666);
-        assert(fd >= 0);
-        FILE * f = fdopen(fd, "r+");
-        assert(f);
-        res = fscanf(f, "%u", &load_dst->dl_number);
-        if(res != 1) {
-            assert(res == EOF);
-            assert(!ferror(f));
-            load_dst->dl_number = 0;
-        }
-        rewind(f);
-        res = fprintf(f, "%u\n", load_dst->dl_number + 1);
-        assert(res > 0);
-        res = fclose(f);
-        assert(res == 0);
-
-        res = sem_post(sem);
-        assert(res == 0);
-        res = sem_close(sem);
-        assert(res == 0);
+        snprintf(dl_path, sizeof(dl_path), DL_PATH DL_PREFIX "%d_%u", (int) getpid(),
+                 atomic_fetch_add(&unique_counter, 1));
 
         int elf_size = m4_elf_nuttx_size();
         void * elf = malloc(elf_size);
         assert(elf);
         m4_elf_nuttx(elf, NATIVE_ARCH, code_offset, bin_len - code_offset);
 
-        snprintf(dl_path, sizeof(dl_path), DL_PATH DL_PREFIX "%u", load_dst->dl_number);
-
         fd = open(dl_path, O_CREAT | O_EXCL | O_WRONLY, 0666);
         assert(fd >= 0);
 
@@ -173,6 +453,8 @@ mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const
 
         load_dst->dl_handle = dlopen(dl_path, RTLD_NOW | RTLD_LOCAL);
         assert(load_dst->dl_handle);
+        res = unlink(dl_path);
+        assert(res == 0);
 
         bin = dlsym(load_dst->dl_handle, "cont");
         assert(bin);
@@ -181,14 +463,46 @@ mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const
     }
 #endif
 
-    error_dst->m4_error_val = run_func(
-        bin,
-        code,
-        memory,
-        memory_len,
-        runtime_cbs,
+    load_dst->bin_len = bin_len;
+    load_dst->run_func = run_func;
+    load_dst->cont = bin;
+    load_dst->code = code;
+    load_dst->memory = memory;
+    load_dst->memory_len = memory_len;
+    load_dst->runtime_cbs = runtime_cbs;
+
+    return MCP_FORTH_ERROR_NONE;
+}
+
+mcp_forth_error_t mcp_forth_run(mcp_forth_load_t * load, mcp_forth_error_info_t * error_dst)
+{
+    mcp_forth_error_info_t dummy_error_dst;
+    if(error_dst == NULL) {
+        error_dst = &dummy_error_dst;
+    }
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_PROFILE
+    if(load->profile) {
+        mcp_forth_profile_enter(load->profile);
+    }
+#endif
+
+    uint32_t t = now_us();
+    error_dst->m4_error_val = load->run_func(
+        load->cont,
+        load->code,
+        load->memory,
+        load->memory_len,
+        load->runtime_cbs,
         &error_dst->missing_runtime_word
     );
+    load->run_us = now_us() - t;
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_PROFILE
+    if(load->profile) {
+        mcp_forth_profile_leave(load->profile);
+    }
+#endif
 
     if(error_dst->m4_error_val) {
         return MCP_FORTH_ERROR_RUNTIME;
@@ -197,6 +511,20 @@ mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const
     return MCP_FORTH_ERROR_NONE;
 }
 
+mcp_forth_error_t mcp_forth_load_and_run_path(mcp_forth_load_t * load_dst, const char * path,
+                                              uint8_t * memory, int memory_len,
+                                              const m4_runtime_cb_array_t * const * runtime_cbs,
+                                              bool native,
+                                              mcp_forth_error_info_t * error_dst)
+{
+    mcp_forth_error_t res = mcp_forth_load_path(load_dst, path, memory, memory_len,
+                                                runtime_cbs, native, error_dst);
+    if(res != MCP_FORTH_ERROR_NONE) {
+        return res;
+    }
+    return mcp_forth_run(load_dst, error_dst);
+}
+
 void mcp_forth_log_error(mcp_forth_error_t load_res, const mcp_forth_error_info_t * load_error)
 {
     switch(load_res) {
@@ -217,6 +545,9 @@ void mcp_forth_log_error(mcp_forth_error_t load_res, const mcp_forth_error_info_
                 fprintf(stderr, "engine error %d\n", load_error->m4_error_val);
             }
             break;
+        case MCP_FORTH_ERROR_MEMORY:
+            fprintf(stderr, "no memory arena for %d bytes\n", load_error->memory_len);
+            break;
     }
 }
 
@@ -224,21 +555,26 @@ void mcp_forth_unload(mcp_forth_load_t * load)
 {
     int res;
 
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_PROFILE
+    if(load->profile) {
+        mcp_forth_profile_destroy(load->profile);
+    }
+#endif
     free(load->bin);
     if(load->dl_handle) {
-        char dl_path[DL_PATH_MAX];
-        snprintf(dl_path, sizeof(dl_path), DL_PATH DL_PREFIX "%u", load->dl_number);
-
         res = dlclose(load->dl_handle);
         assert(res == 0);
-        res = unlink(dl_path);
-        assert(res == 0);
+    }
+    if(load->arena) {
+        mcp_forth_arena_free(load->arena);
     }
 }
 
 static void show_usage(void)
 {
-    fprintf(stderr, "usage: mcp_forth [-m] [-O] <file path>\n");
+    fprintf(stderr, "usage: mcp_forth [-m] [-O] [-p profile_dir] <file path>\n"
+                    "       mcp_forth [-m] [-O] -d\n"
+                    "       mcp_forth -s\n");
 }
 
 static int test_callback_11(int (*cb)(int), int x)
@@ -251,15 +587,140 @@ static const m4_runtime_cb_array_t runtime_test[] = {
     {NULL}
 };
 
+static const m4_runtime_cb_array_t * const cbs[] = {
+    m4_runtime_lib_io,
+    m4_runtime_lib_string,
+    m4_runtime_lib_time,
+    m4_runtime_lib_assert,
+    M4_RUNTIME_LIB_MCP_ALL_ENTRIES
+    runtime_test,
+    NULL
+};
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_DAEMON
+static mqd_t queue_inner_open(int oflag)
+{
+    struct mq_attr attr = {.mq_maxmsg = 8, .mq_msgsize = sizeof(mcp_forth_queue_msg_t)};
+    mqd_t q = mq_open("mcp_forth", oflag, 0666, &attr);
+    assert(q != -1);
+    return q;
+}
+
+mcp_forth_queue_t mcp_forth_queue_open(void)
+{
+    return queue_inner_open(O_WRONLY | O_CREAT);
+}
+
+void mcp_forth_queue_send(mcp_forth_queue_t mq, int peer_id, const char * path)
+{
+    int res;
+
+    mcp_forth_queue_msg_t msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.peer_id = peer_id;
+    assert(strlen(path) < sizeof(msg.path));
+    strcpy(msg.path, path);
+    res = mq_send(mq, (const char *) &msg, sizeof(msg), 10);
+    assert(res == 0);
+}
+
+void mcp_forth_queue_close(mcp_forth_queue_t mq)
+{
+    int res = mq_close(mq);
+    assert(res == 0);
+}
+
+typedef struct {
+    mcp_forth_queue_msg_t msg;
+    bool native;
+} driver_job_t;
+
+/* Each driver gets its own thread and memory. A driver that fails to
+   load or stops with an engine error only ends its own thread. */
+static void * driver_thread(void * arg)
+{
+    driver_job_t * job = arg;
+
+#ifdef CONFIG_MCP_APPS_MCPD
+    mcp_forth_set_thread_peer_id(job->msg.peer_id);
+#endif
+
+    mcp_forth_load_t load;
+    mcp_forth_error_info_t load_error;
+    mcp_forth_error_t load_res = mcp_forth_load_and_run_path(
+        &load,
+        job->msg.path,
+        NULL,
+        0,
+        cbs,
+        job->native,
+        &load_error
+    );
+
+    if(load_res != MCP_FORTH_ERROR_NONE) {
+        fprintf(stderr, "%s: ", job->msg.path);
+        mcp_forth_log_error(load_res, &load_error);
+    }
+
+    mcp_forth_unload(&load);
+    free(job);
+
+    return NULL;
+}
+
+static int run_daemon(bool native)
+{
+    int res;
+    ssize_t rwres;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    mqd_t mq = queue_inner_open(O_RDONLY | O_CREAT);
+
+    while(1) {
+        driver_job_t * job = malloc(sizeof(*job));
+        assert(job);
+        rwres = mq_receive(mq, (char *) &job->msg, sizeof(job->msg), NULL);
+        assert(rwres == sizeof(job->msg));
+        job->msg.path[sizeof(job->msg.path) - 1] = '\0';
+        job->native = native;
+
+        res = pthread_attr_init(&attr);
+        assert(res == 0);
+        res = pthread_attr_setstacksize(&attr, CONFIG_MCP_APPS_MCP_FORTH_DAEMON_STACKSIZE);
+        assert(res == 0);
+        res = pthread_create(&thread, &attr, driver_thread, job);
+        assert(res == 0);
+        res = pthread_detach(thread);
+        assert(res == 0);
+        res = pthread_attr_destroy(&attr);
+        assert(res == 0);
+    }
+
+    /* mcp_forth_queue_close(mq); */
+
+    return 0;
+}
+#endif
+
 int main(int argc, char *argv[])
 {
     char * path;
     bool mount_samples = false;
     bool native = false;
+    bool resident = false;
     int opt;
-    while((opt = getopt(argc, argv, "mO")) >= 0) {
+    while((opt = getopt(argc, argv, "mOdsp:")) >= 0) {
         if(opt == 'm') mount_samples = true;
         else if(opt == 'O') native = true;
+        else if(opt == 'd') resident = true;
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_PROFILE
+        else if(opt == 'p') assert(0 == setenv("MCP_FORTH_PROFILE", optarg, 1));
+#endif
+        else if(opt == 's') {
+            mcp_forth_arena_print_stats(stdout);
+            return 0;
+        }
         else {
             show_usage();
             return 1;
@@ -294,6 +755,15 @@ int main(int argc, char *argv[])
     }
 #endif
 
+    if(resident) {
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_DAEMON
+        return run_daemon(native);
+#else
+        fprintf(stderr, "mcp_forth: built without daemon mode\n");
+        return 1;
+#endif
+    }
+
     if(optind >= argc) {
         if(!mount_samples) {
             show_usage();
@@ -303,26 +773,13 @@ int main(int argc, char *argv[])
     }
     path = argv[optind];
 
-    static const m4_runtime_cb_array_t * const cbs[] = {
-        m4_runtime_lib_io,
-        m4_runtime_lib_string,
-        m4_runtime_lib_time,
-        m4_runtime_lib_assert,
-        M4_RUNTIME_LIB_MCP_ALL_ENTRIES
-        runtime_test,
-        NULL
-    };
-
-    uint8_t * memory = malloc(MEMORY_SIZE);
-    assert(memory);
-
     mcp_forth_load_t load;
     mcp_forth_error_info_t load_error;
     mcp_forth_error_t load_res = mcp_forth_load_and_run_path(
         &load,
         path,
-        memory,
-        MEMORY_SIZE,
+        NULL,
+        0,
         cbs,
         native,
         &load_error
@@ -331,7 +788,6 @@ int main(int argc, char *argv[])
     mcp_forth_log_error(load_res, &load_error);
 
     mcp_forth_unload(&load);
-    free(memory);
     mcp_forth_global_cleanup();
 
     return load_res != MCP_FORTH_ERROR_NONE;
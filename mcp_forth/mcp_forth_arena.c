@@ -0,0 +1,210 @@
+#include <mcp/mcp_forth.h>
+
+#include <nuttx/config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* Forth program memory is carved out of one pool so drivers coming and
+   going don't fragment the heap. The pool is taken from the heap when
+   the first program loads and kept from then on. Free space in the
+   pool is an address ordered list of extents whose headers live in
+   the free space itself. An arena is cut from the end of the first
+   extent it fits in and given back on unload, merged with its free
+   neighbors, so any mix of sizes can reuse it. Past the pool, arenas
+   come from the heap and go back to it. In a flat build every task
+   shares the pool so `mcp_forth -s` sees the programs of every host. */
+
+#define ARENA_GRANULE 64
+#define ARENA_FILL 0xa5
+#define POOL_SIZE CONFIG_MCP_APPS_MCP_FORTH_ARENA_POOL_SIZE
+#define POOL_LEN (POOL_SIZE / ARENA_GRANULE * ARENA_GRANULE)
+
+struct mcp_forth_arena_s {
+    struct mcp_forth_arena_s * next;
+    uint8_t * memory;
+    int len;
+    int declared_len;
+    bool from_pool;
+    char name[32];
+};
+
+/* at the start of a free extent, which is at least ARENA_GRANULE long */
+typedef struct extent_s {
+    struct extent_s * next;
+    size_t len;
+} extent_t;
+
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static mcp_forth_arena_t * live_head;
+#if POOL_LEN
+static uint8_t * pool;
+static extent_t * free_head;
+#endif
+static size_t pool_used;
+
+#if POOL_LEN
+/* call with the arena lock held */
+static uint8_t * pool_take(size_t len)
+{
+    if(len > POOL_LEN) return NULL;
+
+    if(pool == NULL) {
+        pool = malloc(POOL_LEN);
+        if(pool == NULL) return NULL;
+        free_head = (extent_t *) pool;
+        free_head->next = NULL;
+        free_head->len = POOL_LEN;
+    }
+
+    for(extent_t ** pp = &free_head; *pp; pp = &(*pp)->next) {
+        extent_t * ext = *pp;
+        if(ext->len < len) continue;
+        ext->len -= len;
+        if(ext->len == 0) {
+            *pp = ext->next;
+        }
+        pool_used += len;
+        return (uint8_t *) ext + ext->len;
+    }
+
+    return NULL;
+}
+
+/* call with the arena lock held */
+static void pool_give(uint8_t * memory, size_t len)
+{
+    pool_used -= len;
+
+    extent_t * prev = NULL;
+    extent_t * next = free_head;
+    while(next && (uint8_t *) next < memory) {
+        prev = next;
+        next = next->next;
+    }
+
+    if(prev && (uint8_t *) prev + prev->len == memory) {
+        prev->len += len;
+    }
+    else {
+        extent_t * ext = (extent_t *) memory;
+        ext->len = len;
+        ext->next = next;
+        if(prev) prev->next = ext;
+        else free_head = ext;
+        prev = ext;
+    }
+
+    if(next && (uint8_t *) prev + prev->len == (uint8_t *) next) {
+        prev->len += next->len;
+        prev->next = next->next;
+    }
+}
+#endif
+
+mcp_forth_arena_t * mcp_forth_arena_alloc(int len, const char * name)
+{
+    if(len <= 0 || len > CONFIG_MCP_APPS_MCP_FORTH_MEMORY_MAX) return NULL;
+    int arena_len = (len + ARENA_GRANULE - 1) / ARENA_GRANULE * ARENA_GRANULE;
+
+    mcp_forth_arena_t * arena = malloc(sizeof(*arena));
+    assert(arena);
+    arena->len = arena_len;
+    arena->declared_len = len;
+    arena->from_pool = false;
+
+    assert(0 == pthread_mutex_lock(&arena_lock));
+
+#if POOL_LEN
+    arena->memory = pool_take(arena_len);
+    arena->from_pool = arena->memory != NULL;
+#endif
+    if(!arena->from_pool) {
+        arena->memory = malloc(arena_len);
+        if(arena->memory == NULL) {
+            assert(0 == pthread_mutex_unlock(&arena_lock));
+            free(arena);
+            return NULL;
+        }
+    }
+
+    /* keep the end of the name, it's the part that tells paths apart */
+    size_t name_len = strlen(name);
+    if(name_len >= sizeof(arena->name)) name += name_len - (sizeof(arena->name) - 1);
+    strcpy(arena->name, name);
+
+    arena->next = live_head;
+    live_head = arena;
+
+    assert(0 == pthread_mutex_unlock(&arena_lock));
+
+    /* untouched bytes keep this so the high water mark can be found */
+    memset(arena->memory, ARENA_FILL, arena->len);
+
+    return arena;
+}
+
+void mcp_forth_arena_free(mcp_forth_arena_t * arena)
+{
+    assert(0 == pthread_mutex_lock(&arena_lock));
+
+    mcp_forth_arena_t ** pp = &live_head;
+    while(*pp != arena) {
+        assert(*pp);
+        pp = &(*pp)->next;
+    }
+    *pp = arena->next;
+
+#if POOL_LEN
+    if(arena->from_pool) {
+        pool_give(arena->memory, arena->len);
+    }
+#endif
+    if(!arena->from_pool) {
+        free(arena->memory);
+    }
+
+    assert(0 == pthread_mutex_unlock(&arena_lock));
+
+    free(arena);
+}
+
+uint8_t * mcp_forth_arena_memory(const mcp_forth_arena_t * arena, int * len_dst)
+{
+    *len_dst = arena->len;
+    return arena->memory;
+}
+
+int mcp_forth_arena_high_water(const mcp_forth_arena_t * arena)
+{
+    int i = arena->len;
+    while(i && arena->memory[i - 1] == ARENA_FILL) i--;
+    return i;
+}
+
+void mcp_forth_arena_print_stats(FILE * f)
+{
+    assert(0 == pthread_mutex_lock(&arena_lock));
+
+    size_t largest_free = 0;
+#if POOL_LEN
+    largest_free = pool ? 0 : POOL_LEN;
+    for(extent_t * ext = free_head; ext; ext = ext->next) {
+        if(ext->len > largest_free) largest_free = ext->len;
+    }
+#endif
+
+    fprintf(f, "pool_size %d\n", POOL_LEN);
+    fprintf(f, "pool_used %zu\n", pool_used);
+    fprintf(f, "pool_largest_free %zu\n", largest_free);
+    for(mcp_forth_arena_t * arena = live_head; arena; arena = arena->next) {
+        fprintf(f, "%s %d %d %d%s\n", arena->name, arena->declared_len, arena->len,
+                mcp_forth_arena_high_water(arena), arena->from_pool ? "" : " heap");
+    }
+
+    assert(0 == pthread_mutex_unlock(&arena_lock));
+}
@@ -0,0 +1,457 @@
+#include <mcp/mcp_forth.h>
+
+#include <nuttx/config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#ifdef CONFIG_MCP_APPS_MCP_FORTH_PROFILE
+
+/* The engines are not instrumented, so a profile is taken at the
+   boundary between the program and the host: every runtime word the
+   program calls goes through a trampoline that counts and times it.
+   Runtime words that call back into the program nest, so calls are
+   kept as a tree of call paths. Time the program spends in its own
+   words shows up as self time of the path it was called from, down
+   to the program itself at the root. Words the program defines itself
+   are compiled inline by the engine and can't be told apart here.
+   Each thread keeps its own place in the tree since workers and
+   coroutines call runtime words at the same time as the main thread.
+   A thread is inside the program while mcp_forth_run or a host
+   callback bracketed by mcp_forth_profile_enter/leave is running, or
+   while it is in a runtime word. The root's time is the time threads
+   spent inside, and a sampler thread notes which path each thread
+   inside is at every sample period, so a host idling between
+   callbacks isn't charged to the program. Literal words (m4_lit) are
+   left alone since the compiler reads their value directly. */
+
+#define ROOT_FRAME "forth"
+
+typedef struct prof_word_s prof_word_t;
+
+typedef struct prof_node_s {
+    struct prof_node_s * parent;
+    struct prof_node_s * first_child;
+    struct prof_node_s * next_sibling;
+    prof_word_t * word; /* NULL at the root */
+    /* guarded by stats_lock */
+    uint32_t calls;
+    uint32_t samples;
+    uint64_t total_us;
+    /* copied out of the above for a report, guarded by lock */
+    uint32_t rep_calls;
+    uint32_t rep_samples;
+    uint64_t rep_total_us;
+} prof_node_t;
+
+/* a thread inside a program */
+typedef struct prof_thread_s {
+    struct prof_thread_s * next; /* in prof->threads */
+    struct prof_thread_s * outer; /* the program this thread came from */
+    mcp_forth_profile_t * prof;
+    prof_node_t * current; /* read by the sampler */
+    int depth;
+    uint64_t enter_us;
+} prof_thread_t;
+
+struct prof_word_s {
+    const char * name;
+    m4_runtime_cb_pair_t orig;
+    mcp_forth_profile_t * prof;
+};
+
+struct mcp_forth_profile_s {
+    char * out_prefix;
+    const m4_runtime_cb_array_t ** tables;
+    m4_runtime_cb_array_t * entries;
+    prof_word_t * words;
+    int word_count;
+    prof_node_t root;
+    prof_thread_t * threads;
+    uint64_t start_us;
+    pthread_mutex_t lock; /* adding to the tree and the report files */
+    pthread_mutex_t stats_lock; /* the counters and `threads` */
+    pthread_t sampler;
+    bool stop;
+};
+
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t thread_key; /* the innermost prof_thread_t */
+
+static void thread_key_create(void)
+{
+    assert(0 == pthread_key_create(&thread_key, NULL));
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    assert(0 == clock_gettime(CLOCK_MONOTONIC, &ts));
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static prof_node_t * child_find(prof_node_t * parent, prof_word_t * word)
+{
+    /* children are only ever added at the head, after they're filled in */
+    prof_node_t * node = __atomic_load_n(&parent->first_child, __ATOMIC_ACQUIRE);
+    for(; node; node = node->next_sibling) {
+        if(node->word == word) return node;
+    }
+    return NULL;
+}
+
+static prof_node_t * child_get(mcp_forth_profile_t * prof, prof_node_t * parent, prof_word_t * word)
+{
+    prof_node_t * node = child_find(parent, word);
+    if(node) return node;
+
+    assert(0 == pthread_mutex_lock(&prof->lock));
+    /* another thread may have added it in the meantime */
+    node = child_find(parent, word);
+    if(node == NULL) {
+        node = calloc(1, sizeof(*node));
+        assert(node);
+        node->parent = parent;
+        node->word = word;
+        node->next_sibling = parent->first_child;
+        __atomic_store_n(&parent->first_child, node, __ATOMIC_RELEASE);
+    }
+    assert(0 == pthread_mutex_unlock(&prof->lock));
+    return node;
+}
+
+void mcp_forth_profile_enter(mcp_forth_profile_t * prof)
+{
+    assert(0 == pthread_once(&thread_key_once, thread_key_create));
+
+    prof_thread_t * outer = pthread_getspecific(thread_key);
+    if(outer && outer->prof == prof) {
+        outer->depth++;
+        return;
+    }
+
+    prof_thread_t * t = malloc(sizeof(*t));
+    assert(t);
+    t->outer = outer;
+    t->prof = prof;
+    t->current = &prof->root;
+    t->depth = 1;
+    t->enter_us = now_us();
+
+    assert(0 == pthread_mutex_lock(&prof->stats_lock));
+    t->next = prof->threads;
+    prof->threads = t;
+    assert(0 == pthread_mutex_unlock(&prof->stats_lock));
+
+    assert(0 == pthread_setspecific(thread_key, t));
+}
+
+void mcp_forth_profile_leave(mcp_forth_profile_t * prof)
+{
+    prof_thread_t * t = pthread_getspecific(thread_key);
+    assert(t && t->prof == prof);
+    if(--t->depth) return;
+
+    assert(0 == pthread_mutex_lock(&prof->stats_lock));
+    prof->root.total_us += now_us() - t->enter_us;
+    prof_thread_t ** pp = &prof->threads;
+    while(*pp != t) pp = &(*pp)->next;
+    *pp = t->next;
+    assert(0 == pthread_mutex_unlock(&prof->stats_lock));
+
+    assert(0 == pthread_setspecific(thread_key, t->outer));
+    free(t);
+}
+
+static int prof_trampoline(void * param, m4_stack_t * stack)
+{
+    prof_word_t * word = param;
+    mcp_forth_profile_t * prof = word->prof;
+
+    /* a host callback that isn't bracketed is inside for the call */
+    mcp_forth_profile_enter(prof);
+    prof_thread_t * t = pthread_getspecific(thread_key);
+
+    prof_node_t * parent = t->current;
+    prof_node_t * node = child_get(prof, parent, word);
+    __atomic_store_n(&t->current, node, __ATOMIC_RELEASE);
+
+    uint64_t t0 = now_us();
+    int res = word->orig.cb(word->orig.param, stack);
+    uint64_t elapsed = now_us() - t0;
+
+    assert(0 == pthread_mutex_lock(&prof->stats_lock));
+    node->total_us += elapsed;
+    node->calls++;
+    assert(0 == pthread_mutex_unlock(&prof->stats_lock));
+
+    __atomic_store_n(&t->current, parent, __ATOMIC_RELEASE);
+    mcp_forth_profile_leave(prof);
+    return res;
+}
+
+static uint64_t children_total_us(const prof_node_t * node)
+{
+    uint64_t total = 0;
+    for(const prof_node_t * c = node->first_child; c; c = c->next_sibling) {
+        total += c->rep_total_us;
+    }
+    return total;
+}
+
+/* call with both locks held */
+static void node_snapshot(prof_node_t * node)
+{
+    node->rep_calls = node->calls;
+    node->rep_samples = node->samples;
+    node->rep_total_us = node->total_us;
+    for(prof_node_t * c = node->first_child; c; c = c->next_sibling) {
+        node_snapshot(c);
+    }
+}
+
+static void node_free(prof_node_t * node)
+{
+    prof_node_t * c = node->first_child;
+    while(c) {
+        prof_node_t * next = c->next_sibling;
+        node_free(c);
+        free(c);
+        c = next;
+    }
+}
+
+/* self time never goes negative when a call is still in progress */
+static uint64_t self_us(const prof_node_t * node)
+{
+    uint64_t children = children_total_us(node);
+    return node->rep_total_us > children ? node->rep_total_us - children : 0;
+}
+
+static void folded_write(FILE * f, const prof_node_t * node)
+{
+    const prof_node_t * path[64];
+    int depth = 0;
+    for(const prof_node_t * n = node; n->word && depth < 64; n = n->parent) {
+        path[depth++] = n;
+    }
+    fputs(ROOT_FRAME, f);
+    while(depth) {
+        fprintf(f, ";%s", path[--depth]->word->name);
+    }
+    fprintf(f, " %llu\n", (unsigned long long) self_us(node));
+
+    for(const prof_node_t * c = node->first_child; c; c = c->next_sibling) {
+        folded_write(f, c);
+    }
+}
+
+typedef struct {
+    uint32_t calls;
+    uint32_t samples;
+    uint64_t total_us;
+    uint64_t self_us;
+} flat_t;
+
+static void flat_add(flat_t * flat, const mcp_forth_profile_t * prof, const prof_node_t * node)
+{
+    for(const prof_node_t * c = node->first_child; c; c = c->next_sibling) {
+        flat_t * fl = &flat[c->word - prof->words];
+        fl->calls += c->rep_calls;
+        fl->samples += c->rep_samples;
+        fl->self_us += self_us(c);
+        /* recursion through the program is only counted once */
+        bool outer = true;
+        for(const prof_node_t * a = node; a->word; a = a->parent) {
+            if(a->word == c->word) outer = false;
+        }
+        if(outer) fl->total_us += c->rep_total_us;
+        flat_add(flat, prof, c);
+    }
+}
+
+static FILE * report_open(const mcp_forth_profile_t * prof, const char * suffix)
+{
+    char * path;
+    int res = asprintf(&path, "%s%s", prof->out_prefix, suffix);
+    assert(res != -1);
+    FILE * f = fopen(path, "w");
+    if(f == NULL) perror(path);
+    free(path);
+    return f;
+}
+
+static void report_write(mcp_forth_profile_t * prof)
+{
+    assert(0 == pthread_mutex_lock(&prof->lock));
+
+    /* the files are written from a copy so calls don't wait on them */
+    assert(0 == pthread_mutex_lock(&prof->stats_lock));
+    node_snapshot(&prof->root);
+    uint64_t now = now_us();
+    for(prof_thread_t * t = prof->threads; t; t = t->next) {
+        prof->root.rep_total_us += now - t->enter_us;
+    }
+    assert(0 == pthread_mutex_unlock(&prof->stats_lock));
+
+    FILE * f = report_open(prof, ".flat");
+    if(f) {
+        flat_t * flat = calloc(prof->word_count, sizeof(flat_t));
+        assert(flat);
+        flat_add(flat, prof, &prof->root);
+
+        fprintf(f, "word calls total_us self_us samples\n");
+        fprintf(f, "%s 1 %llu %llu %u\n", ROOT_FRAME,
+                (unsigned long long) prof->root.rep_total_us,
+                (unsigned long long) self_us(&prof->root), prof->root.rep_samples);
+        for(int i = 0; i < prof->word_count; i++) {
+            if(!flat[i].calls && !flat[i].samples) continue;
+            fprintf(f, "%s %u %llu %llu %u\n", prof->words[i].name, flat[i].calls,
+                    (unsigned long long) flat[i].total_us,
+                    (unsigned long long) flat[i].self_us, flat[i].samples);
+        }
+        free(flat);
+        assert(0 == fclose(f));
+    }
+
+    f = report_open(prof, ".folded");
+    if(f) {
+        folded_write(f, &prof->root);
+        assert(0 == fclose(f));
+    }
+
+    assert(0 == pthread_mutex_unlock(&prof->lock));
+}
+
+static void * sampler_thread(void * arg)
+{
+    mcp_forth_profile_t * prof = arg;
+
+    uint64_t next_dump_us = prof->start_us
+                            + CONFIG_MCP_APPS_MCP_FORTH_PROFILE_DUMP_INTERVAL * 1000000ull;
+
+    while(!__atomic_load_n(&prof->stop, __ATOMIC_RELAXED)) {
+        usleep(CONFIG_MCP_APPS_MCP_FORTH_PROFILE_SAMPLE_US);
+
+        /* only threads inside the program are sampled */
+        assert(0 == pthread_mutex_lock(&prof->stats_lock));
+        for(prof_thread_t * t = prof->threads; t; t = t->next) {
+            __atomic_load_n(&t->current, __ATOMIC_ACQUIRE)->samples++;
+        }
+        assert(0 == pthread_mutex_unlock(&prof->stats_lock));
+
+        /* drivers usually never finish so the reports are kept current */
+        if(CONFIG_MCP_APPS_MCP_FORTH_PROFILE_DUMP_INTERVAL && now_us() >= next_dump_us) {
+            report_write(prof);
+            next_dump_us += CONFIG_MCP_APPS_MCP_FORTH_PROFILE_DUMP_INTERVAL * 1000000ull;
+        }
+    }
+
+    return NULL;
+}
+
+/* Reports go to `out_dir` + the program path with '/' replaced by '_',
+   + ".flat" and ".folded". */
+mcp_forth_profile_t * mcp_forth_profile_create(const char * out_dir, const char * program_path,
+                                               const m4_runtime_cb_array_t * const * runtime_cbs)
+{
+    int res;
+    pthread_attr_t attr;
+
+    mcp_forth_profile_t * prof = calloc(1, sizeof(*prof));
+    assert(prof);
+
+    res = asprintf(&prof->out_prefix, "%s/%s", out_dir,
+                   program_path[0] == '/' ? program_path + 1 : program_path);
+    assert(res != -1);
+    for(char * c = prof->out_prefix + strlen(out_dir) + 1; *c; c++) {
+        if(*c == '/') *c = '_';
+    }
+
+    int table_count = 0;
+    int entry_count = 0;
+    for(const m4_runtime_cb_array_t * const * t = runtime_cbs; *t; t++) {
+        table_count++;
+        for(const m4_runtime_cb_array_t * cb = *t; cb->name; cb++) {
+            entry_count++;
+        }
+    }
+
+    prof->tables = malloc((table_count + 1) * sizeof(*prof->tables));
+    assert(prof->tables);
+    prof->entries = malloc((entry_count + table_count) * sizeof(*prof->entries));
+    assert(prof->entries);
+    prof->words = malloc(entry_count * sizeof(*prof->words));
+    assert(prof->words);
+
+    m4_runtime_cb_array_t * entry = prof->entries;
+    for(int i = 0; i < table_count; i++) {
+        prof->tables[i] = entry;
+        for(const m4_runtime_cb_array_t * cb = runtime_cbs[i]; cb->name; cb++) {
+            *entry = *cb;
+            if(cb->cb.cb != m4_lit) {
+                prof_word_t * word = &prof->words[prof->word_count++];
+                word->name = cb->name;
+                word->orig = cb->cb;
+                word->prof = prof;
+                entry->cb.cb = prof_trampoline;
+                entry->cb.param = word;
+            }
+            entry++;
+        }
+        memset(entry++, 0, sizeof(*entry));
+    }
+    prof->tables[table_count] = NULL;
+
+    prof->start_us = now_us();
+    res = pthread_mutex_init(&prof->lock, NULL);
+    assert(res == 0);
+    res = pthread_mutex_init(&prof->stats_lock, NULL);
+    assert(res == 0);
+
+    res = pthread_attr_init(&attr);
+    assert(res == 0);
+    res = pthread_attr_setstacksize(&attr, CONFIG_MCP_APPS_MCP_FORTH_PROFILE_STACKSIZE);
+    assert(res == 0);
+    res = pthread_create(&prof->sampler, &attr, sampler_thread, prof);
+    assert(res == 0);
+    res = pthread_attr_destroy(&attr);
+    assert(res == 0);
+
+    return prof;
+}
+
+const m4_runtime_cb_array_t * const * mcp_forth_profile_runtime_cbs(const mcp_forth_profile_t * prof)
+{
+    return prof->tables;
+}
+
+void mcp_forth_profile_destroy(mcp_forth_profile_t * prof)
+{
+    int res;
+
+    __atomic_store_n(&prof->stop, true, __ATOMIC_RELAXED);
+    res = pthread_join(prof->sampler, NULL);
+    assert(res == 0);
+
+    report_write(prof);
+
+    node_free(&prof->root);
+    res = pthread_mutex_destroy(&prof->lock);
+    assert(res == 0);
+    res = pthread_mutex_destroy(&prof->stats_lock);
+    assert(res == 0);
+    free(prof->words);
+    free(prof->entries);
+    free(prof->tables);
+    free(prof->out_prefix);
+    free(prof);
+}
+
+#endif
@@ -0,0 +1,246 @@
+/* Host tool. Compiles a Forth program ahead of time into an image that
+   mcp_forth loads instead of compiling the source, see
+   include/mcp/mcp_forth_image.h. Built by `make mcp_forth_aot` with the
+   host compiler, it links the same compiler and backends as the
+   device, so its output is what the device would have compiled, and
+   the images carry the same build ID. Images are written in host byte
+   order, which is little endian on every host and target this
+   supports. */
+
+#include "../mcp_forth/mcp_forth.h"
+#include "../mcp_forth_build_id.h"
+#include <mcp/mcp_forth_image.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+
+#define PATH_MAX_LEN 256
+
+typedef struct {
+    int id;
+    const m4_backend_t * backend;
+} aot_backend_t;
+
+static const aot_backend_t aot_backends[] = {
+    {MCP_FORTH_IMAGE_BACKEND_VM, &m4_compact_bytecode_vm_backend},
+#ifdef MCP_FORTH_AOT_X86_32
+    {MCP_FORTH_IMAGE_BACKEND_X86_32, &m4_x86_32_backend},
+#endif
+#ifdef MCP_FORTH_AOT_ESP32S3
+    {MCP_FORTH_IMAGE_BACKEND_ESP32S3, &m4_esp32s3_backend},
+#endif
+};
+
+static const char * const backend_names[] = MCP_FORTH_IMAGE_BACKEND_NAMES;
+
+static void show_usage(void)
+{
+    fprintf(stderr, "usage: mcp_forth_aot [-b backend] [-o image_path] <source path>\n"
+                    "  backend     one of");
+    for(int i = 0; i < sizeof(aot_backends) / sizeof(*aot_backends); i++) {
+        fprintf(stderr, " %s", backend_names[aot_backends[i].id]);
+    }
+    fprintf(stderr, ", default vm\n"
+                    "  image_path  default <source path>.<backend>" MCP_FORTH_IMAGE_PAYLOAD_SUFFIX "\n");
+}
+
+/* SHA-256 of the source, what the device's mcp_fs cache names it by */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t * h, const uint8_t * p)
+{
+    uint32_t w[64];
+    for(int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[i * 4] << 24 | (uint32_t) p[i * 4 + 1] << 16
+               | (uint32_t) p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for(int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for(int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g))
+                      + sha256_k[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+static void sha256(uint8_t * dst, const uint8_t * src, size_t len)
+{
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    size_t pos = 0;
+    for(; len - pos >= 64; pos += 64) {
+        sha256_block(h, src + pos);
+    }
+
+    uint8_t tail[128];
+    size_t tail_len = len - pos;
+    memcpy(tail, src + pos, tail_len);
+    tail[tail_len++] = 0x80;
+    size_t padded_len = tail_len + 8 <= 64 ? 64 : 128;
+    memset(tail + tail_len, 0, padded_len - tail_len);
+    uint64_t bits = (uint64_t) len * 8;
+    for(int i = 0; i < 8; i++) {
+        tail[padded_len - 1 - i] = bits >> (i * 8);
+    }
+    for(size_t i = 0; i < padded_len; i += 64) {
+        sha256_block(h, tail + i);
+    }
+
+    for(int i = 0; i < 8; i++) {
+        dst[i * 4] = h[i] >> 24;
+        dst[i * 4 + 1] = h[i] >> 16;
+        dst[i * 4 + 2] = h[i] >> 8;
+        dst[i * 4 + 3] = h[i];
+    }
+}
+
+static char * file_read(const char * path, size_t * len_dst)
+{
+    FILE * f = fopen(path, "rb");
+    if(f == NULL) return NULL;
+
+    size_t cap = 4096;
+    size_t len = 0;
+    char * buf = malloc(cap);
+    assert(buf);
+    size_t n;
+    while((n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if(len == cap) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            assert(buf);
+        }
+    }
+    bool ok = !ferror(f);
+    assert(0 == fclose(f));
+    if(!ok) {
+        free(buf);
+        return NULL;
+    }
+
+    *len_dst = len;
+    return buf;
+}
+
+int main(int argc, char *argv[])
+{
+    int res;
+    const char * backend_name = "vm";
+    const char * image_path = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "b:o:")) >= 0) {
+        if(opt == 'b') backend_name = optarg;
+        else if(opt == 'o') image_path = optarg;
+        else {
+            show_usage();
+            return 1;
+        }
+    }
+    if(optind != argc - 1) {
+        show_usage();
+        return 1;
+    }
+    const char * source_path = argv[optind];
+
+    const aot_backend_t * backend = NULL;
+    for(int i = 0; i < sizeof(aot_backends) / sizeof(*aot_backends); i++) {
+        if(0 == strcmp(backend_name, backend_names[aot_backends[i].id])) {
+            backend = &aot_backends[i];
+        }
+    }
+    if(backend == NULL) {
+        fprintf(stderr, "backend \"%s\" not built in\n", backend_name);
+        show_usage();
+        return 1;
+    }
+
+    size_t source_len;
+    char * source = file_read(source_path, &source_len);
+    if(source == NULL) {
+        perror(source_path);
+        return 1;
+    }
+
+    uint8_t * bin;
+    int code_offset;
+    int error_near;
+    int bin_len = m4_compile(source, source_len, &bin, &code_offset,
+                             backend->backend, &error_near);
+    if(bin_len < 0) {
+        fprintf(stderr, "%s: m4_compile: error %d near %d\n", source_path, bin_len, error_near);
+        free(source);
+        return 1;
+    }
+
+    mcp_forth_image_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MCP_FORTH_IMAGE_MAGIC;
+    hdr.version = MCP_FORTH_IMAGE_VERSION;
+    hdr.backend = backend->id;
+    hdr.build_id = MCP_FORTH_BUILD_ID;
+    sha256(hdr.source_sha256, (const uint8_t *) source, source_len);
+    hdr.declared_memory_len = mcp_forth_source_declared_memory_len(source, source_len);
+    hdr.code_offset = code_offset;
+    hdr.bin_len = bin_len;
+    free(source);
+
+    char default_path[PATH_MAX_LEN];
+    if(image_path == NULL) {
+        res = snprintf(default_path, sizeof(default_path), "%s.%s" MCP_FORTH_IMAGE_PAYLOAD_SUFFIX,
+                       source_path, backend_name);
+        assert(res > 0 && res < sizeof(default_path));
+        image_path = default_path;
+    }
+
+    FILE * f = fopen(image_path, "wb");
+    if(f == NULL) {
+        perror(image_path);
+        free(bin);
+        return 1;
+    }
+    bool ok = 1 == fwrite(&hdr, sizeof(hdr), 1, f)
+              && 1 == fwrite(bin, bin_len, 1, f);
+    ok = 0 == fclose(f) && ok;
+    free(bin);
+    if(!ok) {
+        perror(image_path);
+        unlink(image_path);
+        return 1;
+    }
+
+    printf("%s: %s, %d bytes, build %08x, declared memory %d\n", image_path,
+           backend_name, bin_len, (unsigned) hdr.build_id, (int) hdr.declared_memory_len);
+
+    return 0;
+}
@@ -0,0 +1,253 @@
+#include <nuttx/config.h>
+
+#include <mcp/mcp_forth.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <sys/stat.h>
+
+#ifdef CONFIG_MCP_APPS_MCP_LVGL
+    #include <lvgl/lvgl.h>
+#endif
+
+#define DEFAULT_DIR "/tmp/mcp_forth_bench"
+#define DEFAULT_ITERATIONS 5
+
+typedef struct {
+    const char * name;
+    const char * source;
+} workload_t;
+
+typedef struct {
+    const char * name;
+    bool native;
+} backend_t;
+
+typedef struct {
+    FILE * files[2];
+    int file_count;
+} report_t;
+
+/* Every workload only uses core words and the bindings every host has,
+   so a difference between backends is the backends'. */
+static const workload_t workloads[] = {
+    {"arith",
+        "\\ mcp_forth memory 1024\n"
+        ": arith 0 200000 0 do i 3 * + 65535 and loop drop ;\n"
+        "arith\n"},
+    {"memcpy",
+        "\\ mcp_forth memory 1024\n"
+        "4096 malloc constant src\n"
+        "4096 malloc constant dst\n"
+        ": fill 4096 0 do i src i + c! loop ;\n"
+        ": copy 4096 0 do src i + c@ dst i + c! loop ;\n"
+        ": copies 20 0 do copy loop ;\n"
+        "fill copies\n"
+        "src free dst free\n"},
+    {"callback_io",
+        "\\ mcp_forth memory 1024\n"
+        "64 malloc constant buf\n"
+        ": writes 5000 0 do bench_null_fd buf 64 write drop loop ;\n"
+        "writes\n"
+        "buf free\n"},
+#ifdef CONFIG_MCP_APPS_MCP_LVGL
+    {"lvgl_ui",
+        "\\ mcp_forth memory 1024\n"
+        ": labels 200 0 do dup lv_label_create i 4 * i 2 * lv_obj_set_pos loop ;\n"
+        ": ui 10 0 do 0 lv_obj_create labels lv_obj_delete loop ;\n"
+        "ui\n"},
+#endif
+};
+
+static const backend_t backends[] = {
+    {"vm", false},
+#ifndef CONFIG_MCP_APPS_MCP_FORTH_NATIVE_NONE
+    {"native", true},
+#endif
+};
+
+static m4_runtime_cb_array_t runtime_bench[] = {
+    {"bench_null_fd", {m4_lit, NULL}},
+    {NULL}
+};
+
+static const m4_runtime_cb_array_t * const cbs[] = {
+    m4_runtime_lib_io,
+    m4_runtime_lib_string,
+    m4_runtime_lib_time,
+    m4_runtime_lib_assert,
+    M4_RUNTIME_LIB_MCP_ALL_ENTRIES
+    runtime_bench,
+    NULL
+};
+
+static void show_usage(void)
+{
+    fprintf(stderr, "usage: mcp_forth_bench [-l] [-d work_dir] [-n iterations] [-o report_path]\n");
+}
+
+/* one "key value" line per measurement, same as mcp_fs_bench */
+static void report(report_t * r, const char * workload, const char * backend,
+                   const char * key, uint64_t value)
+{
+    for(int i = 0; i < r->file_count; i++) {
+        fprintf(r->files[i], "%s_%s_%s %llu\n", workload, backend, key,
+                (unsigned long long) value);
+    }
+}
+
+static bool write_source(const char * path, const char * source)
+{
+    ssize_t rwres;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) return false;
+    size_t len = strlen(source);
+    rwres = write(fd, source, len);
+    return 0 == close(fd) && rwres == len;
+}
+
+static void bench_one(report_t * r, const char * path, const workload_t * w,
+                      const backend_t * b, int iterations)
+{
+    uint32_t compile_us = UINT32_MAX;
+    uint32_t run_us = UINT32_MAX;
+    int bin_len = 0;
+    int high_water = 0;
+    int heap_bytes = 0;
+    bool ok = true;
+
+    /* the fastest of the iterations, it's the least disturbed */
+    for(int i = 0; ok && i < iterations; i++) {
+        struct mallinfo before = mallinfo();
+
+        mcp_forth_load_t load;
+        mcp_forth_error_info_t load_error;
+        mcp_forth_error_t load_res = mcp_forth_load_and_run_path(
+            &load, path, NULL, 0, cbs, b->native, &load_error);
+
+        if(load_res == MCP_FORTH_ERROR_NONE) {
+            struct mallinfo after = mallinfo();
+            if(load.compile_us < compile_us) compile_us = load.compile_us;
+            if(load.run_us < run_us) run_us = load.run_us;
+            bin_len = load.bin_len;
+            high_water = mcp_forth_arena_high_water(load.arena);
+            heap_bytes = after.uordblks - before.uordblks;
+        }
+        else {
+            fprintf(stderr, "%s %s: ", w->name, b->name);
+            mcp_forth_log_error(load_res, &load_error);
+            ok = false;
+        }
+
+        mcp_forth_unload(&load);
+    }
+
+    report(r, w->name, b->name, "ok", ok);
+    if(!ok) return;
+    report(r, w->name, b->name, "compile_us", compile_us);
+    report(r, w->name, b->name, "code_bytes", bin_len);
+    report(r, w->name, b->name, "memory_high_water", high_water);
+    report(r, w->name, b->name, "heap_bytes", heap_bytes);
+    report(r, w->name, b->name, "run_us", run_us);
+}
+
+int mcp_forth_bench_main(int argc, char *argv[])
+{
+    int res;
+    const char * dir = DEFAULT_DIR;
+    int iterations = DEFAULT_ITERATIONS;
+    const char * report_path = NULL;
+    bool with_lvgl = false;
+
+    int opt;
+    while((opt = getopt(argc, argv, "ld:n:o:")) >= 0) {
+        if(opt == 'l') with_lvgl = true;
+        else if(opt == 'd') dir = optarg;
+        else if(opt == 'n') iterations = atoi(optarg);
+        else if(opt == 'o') report_path = optarg;
+        else {
+            show_usage();
+            return 1;
+        }
+    }
+    if(iterations < 1) {
+        show_usage();
+        return 1;
+    }
+
+    res = mkdir(dir, 0777);
+    if(res < 0 && access(dir, F_OK) != 0) {
+        perror(dir);
+        return 1;
+    }
+
+    int null_fd = open("/dev/null", O_WRONLY);
+    assert(null_fd >= 0);
+    runtime_bench[0].cb.param = (void *)(intptr_t) null_fd;
+
+#ifdef CONFIG_MCP_APPS_MCP_LVGL
+    /* the UI workload needs LVGL to itself, so mcp_lvgl must not be running */
+    lv_display_t * disp = NULL;
+    if(with_lvgl) {
+        lv_init();
+        disp = lv_display_create(320, 240);
+    }
+#endif
+
+    report_t r;
+    r.files[0] = stdout;
+    r.file_count = 1;
+    if(report_path) {
+        r.files[1] = fopen(report_path, "w");
+        if(r.files[1] == NULL) {
+            perror("fopen");
+            return 1;
+        }
+        r.file_count = 2;
+    }
+
+    /* The arena pool is taken from the heap by the first load and kept,
+       so it's taken here to keep it out of the first heap_bytes. */
+    mcp_forth_arena_t * pool_warm = mcp_forth_arena_alloc(1, "mcp_forth_bench");
+    assert(pool_warm);
+
+    char path[128];
+    for(int i = 0; i < sizeof(workloads) / sizeof(*workloads); i++) {
+        const workload_t * w = &workloads[i];
+        if(0 == strncmp(w->name, "lvgl", 4) && !with_lvgl) continue;
+
+        res = snprintf(path, sizeof(path), "%s/%s.4th", dir, w->name);
+        assert(res > 0 && res < sizeof(path));
+        if(!write_source(path, w->source)) {
+            perror(path);
+            continue;
+        }
+
+        for(int j = 0; j < sizeof(backends) / sizeof(*backends); j++) {
+            bench_one(&r, path, w, &backends[j], iterations);
+        }
+    }
+
+    mcp_forth_arena_free(pool_warm);
+
+    if(report_path) assert(0 == fclose(r.files[1]));
+
+#ifdef CONFIG_MCP_APPS_MCP_LVGL
+    if(disp) {
+        lv_display_delete(disp);
+        lv_deinit();
+    }
+#endif
+
+    assert(0 == close(null_fd));
+    mcp_forth_global_cleanup();
+
+    return 0;
+}
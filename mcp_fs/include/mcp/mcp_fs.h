@@ -1,4 +1,32 @@
 #pragma once
 
+#include <stdint.h>
+
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t evicted_bytes;
+    uint32_t revalidations; /* file hashes reused because the generation was unchanged */
+    uint32_t delta_fills; /* misses filled from the previous version plus changed blocks */
+    uint32_t delta_saved_bytes;
+    uint32_t used_bytes;
+    uint32_t budget_bytes; /* 0 means no limit */
+} mcp_fs_cache_stats_t;
+
+/* The cache entry of a module file, opened read only, or -1 if it isn't
+   cached and can't be. It is opened before it can be evicted and stays
+   readable after. `cachepath_dst`, if not NULL, gets the entry's path or
+   NULL, e.g. to name files derived from it. */
+int mcp_fs_cache_open(const char * file_path, char ** cachepath_dst);
+/* The path of the cache entry, to tell versions apart or to fill it
+   ahead of time. It may be evicted before it is opened. */
 char * mcp_fs_cache_file(const char * file_path);
+/* The path the entry of a module file has or would have, without
+   filling it or marking it used, to notice a new version cheaply. */
+char * mcp_fs_cache_name(const char * file_path);
+/* Mark an entry or a file derived from it as just used. */
+void mcp_fs_cache_touch(const char * cachepath);
+void mcp_fs_cache_reconcile(void);
+void mcp_fs_cache_get_stats(mcp_fs_cache_stats_t * stats_dst);
 int mcp_fs_path_get_peer_id(const char * file_path);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <mqueue.h>
+
+/* mcp_fs announces each arriving module here once its mount is usable
+   so whoever loads the module's driver doesn't race the mount. */
+
+typedef mqd_t mcp_fs_ready_t;
+
+mcp_fs_ready_t mcp_fs_ready_open(void);
+int mcp_fs_ready_wait(mcp_fs_ready_t mq);
+void mcp_fs_ready_close(mcp_fs_ready_t mq);
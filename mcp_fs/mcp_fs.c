@@ -1,4 +1,7 @@
+#include <nuttx/config.h>
+
 #include <mcp/mcp_fs.h>
+#include <mcp/mcp_fs_ready.h>
 #include <mcp/mcpd.h>
 #include <nuttx/fs/userfs.h>
 #include <string.h>
@@ -7,76 +10,61 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <fcntl.h>
-#include <semaphore.h>
+#include <unistd.h>
 #include <sys/stat.h>
-#include <sys/sendfile.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <time.h>
 
-#define MNT_MCP "/mnt/mcp/"
-#define MNT_CACHE "/data/"
+#include "mcp_fs_private.h"
 
-#define FS_BASE_ACTION_WRITE      0
-#define FS_BASE_ACTION_READ       1
-#define FS_BASE_ACTION_LS         2
-#define FS_BASE_ACTION_DELETE     3
+/* Listing protocol (5). Same as the LS action of the fs protocol but
+   every name is preceded by what the STAT action would give for it:
+   mode u16, size u32, blksize u16, then the NUL terminated name. A
+   separate protocol so modules without it fall back cleanly. */
+#define LS_STAT_PROTOCOL               5
+#define LS_STAT_HEADER_LEN             (2 + 4 + 2)
 
-#define FS_OPEN_FILE_ACTION_CONTINUE   0
-#define FS_OPEN_FILE_ACTION_CLOSE      1
-#define FS_OPEN_FILE_ACTION_STAT       2
+#define MOUNT_WAIT_MS 50
 
+#define READY_QUEUE_NAME "mcp_fs_ready"
+#define READY_QUEUE_LEN  8
+
+/* Every peer is its own userfs mount at /mnt/mcp/N served by its own
+   thread. userfs serializes the requests of one mount so this way a slow
+   module only holds up requests for itself. */
 typedef struct {
+    int peer_id;
     mcpd_con_t con;
     int refcount;
-    bool has_been_connected_to;
     bool is_reading;
-} peer_t;
-
-typedef struct {
-    int peer_count;
-    int self_index;
-    peer_t * peers;
+    bool ls_stat_unsupported;
+    struct dir_s * stat_dir; /* op_stat answers from here while it's open */
     int open_dir_count; /*for asserting*/
     bool was_destroyed; /*for asserting*/
 } volinfo_t;
 
-typedef struct {
-    bool is_root;
+typedef struct dir_s {
+    bool has_stat;
     int count;
     int cursor;
     char fnames[];
 } dir_t;
 
-static const uint8_t sha256_emptyfile[32] = {
-    0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14,
-    0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
-    0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c,
-    0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55
-};
+typedef enum {
+    MOUNT_NONE,
+    MOUNT_PENDING, /* its thread is running but the mount wasn't seen yet */
+    MOUNT_OK
+} mount_state_t;
 
-static void raw_to_hex(char * dst, const uint8_t * src, size_t len) {
-    for(size_t i = 0; i < len; i++) {
-        char buf[3];
-        sprintf(buf, "%02x", (unsigned) src[i]);
-        dst[i*2] = buf[0];
-        dst[i*2 + 1] = buf[1];
-    }
-}
-
-static peer_t * volinfo_ensure_peer(volinfo_t * vinfo, int peer_id)
-{
-    if(peer_id < vinfo->peer_count) return &vinfo->peers[peer_id];
-    int new_peer_count = peer_id + 1;
-    vinfo->peers = realloc(vinfo->peers, new_peer_count * sizeof(peer_t));
-    assert(vinfo->peers);
-    for(int i = vinfo->peer_count; i < new_peer_count; i++) {
-        vinfo->peers[i].con = MCPD_CON_NULL;
-        vinfo->peers[i].has_been_connected_to = false;
-    }
-    vinfo->peer_count = new_peer_count;
-    return &vinfo->peers[peer_id];
-}
+static pthread_mutex_t mounted_mutex = PTHREAD_MUTEX_INITIALIZER;
+static mount_state_t mounted[255];
+static sem_t mount_ended[255]; /* posted when a peer's userfs_run returns */
+static mqd_t ready_mq;
 
-static int decode_path(const char ** srcdst)
+int mcp_fs_util_decode_path(const char ** srcdst)
 {
     int id = 0;
     const char * p = *srcdst;
@@ -101,12 +89,14 @@ static int decode_path(const char ** srcdst)
     return id;
 }
 
-static bool check_peer_is_present(int peer_id)
+static bool check_peer_is_present(volinfo_t * vinfo)
 {
     int res;
 
+    if(vinfo->con != MCPD_CON_NULL) return true;
+
     mcpd_con_t con;
-    res = mcpd_connect(&con, peer_id);
+    res = mcpd_connect(&con, vinfo->peer_id);
 
     if(res == MCPD_DOESNT_EXIST) {
         return false;
@@ -141,28 +131,16 @@ static int op_open(FAR void *volinfo, FAR const char *relpath,
     if(*relpath == '\0') return -EISDIR;
 
     const char * p = relpath;
-    int peer_id = decode_path(&p);
-
-    if(peer_id < 0) return -ENOENT;
-
-    if(peer_id == vinfo->self_index) return -ENOENT;
+    if(NULL != strchr(p, '/')) return -ENOENT;
 
-    if(*p == '\0') return -EISDIR;
-
-    peer_t * peer = peer_id < vinfo->peer_count ? &vinfo->peers[peer_id] : NULL;
-
-    if(peer && peer->con != MCPD_CON_NULL) return -EBUSY;
+    if(vinfo->con != MCPD_CON_NULL) return -EBUSY;
 
     size_t filename_len = strlen(p);
     if(filename_len > 255) return -ENAMETOOLONG;
 
     mcpd_con_t con;
-    res = mcpd_connect(&con, peer_id);
+    res = mcpd_connect(&con, vinfo->peer_id);
     if(res == MCPD_DOESNT_EXIST) return -ENOENT;
-
-    peer = volinfo_ensure_peer(vinfo, peer_id);
-    peer->has_been_connected_to = true;
-
     if(res == MCPD_BUSY) return -EBUSY;
     assert(res == MCPD_OK);
 
@@ -194,19 +172,17 @@ static int op_open(FAR void *volinfo, FAR const char *relpath,
         assert(0);
     }
 
-    peer->con = con;
-    peer->refcount = 1;
-    peer->is_reading = accmode == O_RDONLY;
-    *openinfo = (void *)(intptr_t) peer_id;
+    vinfo->con = con;
+    vinfo->refcount = 1;
+    vinfo->is_reading = accmode == O_RDONLY;
+    if(!vinfo->is_reading) vinfo->stat_dir = NULL; /* it'll be stale */
+    *openinfo = vinfo;
     return 0;
 }
 
 static int op_close(FAR void *volinfo, FAR void *openinfo)
 {
-    volinfo_t * vinfo = volinfo;
-    int peer_id = (intptr_t) openinfo;
-
-    peer_t * peer = &vinfo->peers[peer_id];
+    volinfo_t * peer = openinfo;
 
     if(--peer->refcount) return 0;
 
@@ -230,10 +206,7 @@ static int op_close(FAR void *volinfo, FAR void *openinfo)
 static ssize_t op_read(FAR void *volinfo, FAR void *openinfo,
     FAR char *buffer, size_t buflen)
 {
-    volinfo_t * vinfo = volinfo;
-    int peer_id = (intptr_t) openinfo;
-
-    peer_t * peer = &vinfo->peers[peer_id];
+    volinfo_t * peer = openinfo;
 
     if(!peer->is_reading) return -EBADF;
 
@@ -270,10 +243,7 @@ static ssize_t op_read(FAR void *volinfo, FAR void *openinfo,
 static ssize_t op_write(FAR void *volinfo, FAR void *openinfo,
     FAR const char *buffer, size_t buflen)
 {
-    volinfo_t * vinfo = volinfo;
-    int peer_id = (intptr_t) openinfo;
-
-    peer_t * peer = &vinfo->peers[peer_id];
+    volinfo_t * peer = openinfo;
 
     if(peer->is_reading) return -EBADF;
 
@@ -316,10 +286,7 @@ static int op_sync(FAR void *volinfo, FAR void *openinfo)
 static int op_dup(FAR void *volinfo, FAR void *oldinfo,
     FAR void **newinfo)
 {
-    volinfo_t * vinfo = volinfo;
-    int peer_id = (intptr_t) oldinfo;
-
-    peer_t * peer = &vinfo->peers[peer_id];
+    volinfo_t * peer = oldinfo;
 
     peer->refcount++;
 
@@ -330,10 +297,7 @@ static int op_dup(FAR void *volinfo, FAR void *oldinfo,
 static int op_fstat(FAR void *volinfo, FAR void *openinfo,
     FAR struct stat *statbuf)
 {
-    volinfo_t * vinfo = volinfo;
-    int peer_id = (intptr_t) openinfo;
-
-    peer_t * peer = &vinfo->peers[peer_id];
+    volinfo_t * peer = openinfo;
 
     memset(statbuf, 0, sizeof(*statbuf));
 
@@ -373,80 +337,55 @@ static int op_opendir(FAR void *volinfo, FAR const char *relpath,
 
     volinfo_t * vinfo = volinfo;
 
-    if(*relpath == '\0') {
-        for(int i = 0; i < vinfo->peer_count; i++) {
-            peer_t * peer = &vinfo->peers[i];
-            if(peer->con == MCPD_CON_NULL
-               && !peer->has_been_connected_to
-               && i != vinfo->self_index) {
-                if(check_peer_is_present(i)) {
-                    peer->has_been_connected_to = true;
-                } else {
-                    assert(vinfo->self_index < 0);
-                    vinfo->self_index = i;
-                }
-            }
-        }
-        while(1) {
-            if(check_peer_is_present(vinfo->peer_count)) {
-                peer_t * peer = volinfo_ensure_peer(vinfo, vinfo->peer_count);
-                peer->has_been_connected_to = true;
-            }
-            else if(vinfo->self_index < 0) {
-                vinfo->self_index = vinfo->peer_count;
-                volinfo_ensure_peer(vinfo, vinfo->peer_count);
-            }
-            else break;
-        };
-
-        dir_t * dir = malloc(sizeof(dir_t));
-        assert(dir);
-        dir->is_root = true;
-        dir->count = vinfo->peer_count;
-        dir->cursor = 0;
-
-        vinfo->open_dir_count++;
-        *dir_dst = dir;
-        return 0;
-    }
-
-    const char * p = relpath;
-    int peer_id = decode_path(&p);
+    if(*relpath != '\0') return -ENOTDIR;
 
-    if(peer_id < 0 || peer_id == vinfo->self_index) return -ENOENT;
-    if(*p != '\0') return -ENOTDIR;
-
-    peer_t * peer = peer_id < vinfo->peer_count ? &vinfo->peers[peer_id] : NULL;
-    if(peer && peer->con != MCPD_CON_NULL) return -EBUSY;
+    if(vinfo->con != MCPD_CON_NULL) return -EBUSY;
 
     mcpd_con_t con;
-    res = mcpd_connect(&con, peer_id);
+    res = mcpd_connect(&con, vinfo->peer_id);
     if(res == MCPD_DOESNT_EXIST) return -ENOENT;
-
-    peer = volinfo_ensure_peer(vinfo, peer_id);
-    peer->has_been_connected_to = true;
-
     if(res == MCPD_BUSY) return -EBUSY;
     assert(res == MCPD_OK);
 
     uint8_t buf[1];
+    bool has_stat = false;
 
-    buf[0] = 0; // protocol
-    mcpd_write(con, buf, 1);
-    mcpd_read(con, buf, 1);
+    if(!vinfo->ls_stat_unsupported) {
+        buf[0] = LS_STAT_PROTOCOL;
+        mcpd_write(con, buf, 1);
+        mcpd_read(con, buf, 1);
+        if(buf[0] == 0) {
+            has_stat = true;
+        } else {
+            vinfo->ls_stat_unsupported = true;
+            mcpd_disconnect(con);
+            res = mcpd_connect(&con, vinfo->peer_id);
+            if(res == MCPD_DOESNT_EXIST) return -ENOENT;
+            if(res == MCPD_BUSY) return -EBUSY;
+            assert(res == MCPD_OK);
+        }
+    }
 
     uint32_t byte_count;
-    if(buf[0] != 0) { // protocol not supported
-        byte_count = 0;
+    if(has_stat) {
+        mcpd_read(con, &byte_count, sizeof(byte_count));
     } else {
-        buf[0] = FS_BASE_ACTION_LS;
+        buf[0] = 0; // protocol
         mcpd_write(con, buf, 1);
-        mcpd_read(con, &byte_count, sizeof(byte_count));
+        mcpd_read(con, buf, 1);
+
+        if(buf[0] != 0) { // protocol not supported
+            byte_count = 0;
+        } else {
+            buf[0] = FS_BASE_ACTION_LS;
+            mcpd_write(con, buf, 1);
+            mcpd_read(con, &byte_count, sizeof(byte_count));
+        }
     }
 
     dir_t * dir = malloc(sizeof(dir_t) + byte_count);
     assert(dir);
-    dir->is_root = false;
+    dir->has_stat = has_stat;
     dir->count = byte_count;
     dir->cursor = 0;
 
@@ -454,6 +393,8 @@ static int op_opendir(FAR void *volinfo, FAR const char *relpath,
 
     mcpd_disconnect(con);
 
+    if(has_stat) vinfo->stat_dir = dir;
+
     vinfo->open_dir_count++;
     *dir_dst = dir;
     return 0;
@@ -463,36 +404,52 @@ static int op_closedir(FAR void *volinfo, FAR void *dir)
 {
     volinfo_t * vinfo = volinfo;
     vinfo->open_dir_count--;
+    if(vinfo->stat_dir == dir) vinfo->stat_dir = NULL;
     free(dir);
     return 0;
 }
 
+static bool dir_find_stat(const dir_t * dir, const char * name, struct stat * buf)
+{
+    int pos = 0;
+    while(pos < dir->count) {
+        const char * header = dir->fnames + pos;
+        const char * fname = header + LS_STAT_HEADER_LEN;
+        size_t fname_len = strlen(fname);
+        if(0 == strcmp(fname, name)) {
+            uint16_t mode;
+            uint32_t size;
+            uint16_t blksize;
+            memcpy(&mode, header, 2);
+            memcpy(&size, header + 2, 4);
+            memcpy(&blksize, header + 6, 2);
+
+            memset(buf, 0, sizeof(*buf));
+            buf->st_mode = mode | S_IFREG;
+            buf->st_size = size;
+            buf->st_blksize = blksize;
+            return true;
+        }
+        pos += LS_STAT_HEADER_LEN + fname_len + 1;
+    }
+    return false;
+}
+
 static int op_readdir(FAR void *volinfo, FAR void *dir_void,
     FAR struct dirent *entry)
 {
-    int res;
-
-    volinfo_t * vinfo = volinfo;
     dir_t * dir = dir_void;
 
-    if(dir->is_root && dir->cursor == vinfo->self_index) dir->cursor++;
-
     if(dir->cursor >= dir->count) return -ENOENT;
 
     memset(entry, 0, sizeof(*entry));
 
-    if(dir->is_root) {
-        entry->d_type = DT_DIR;
-        res = snprintf(entry->d_name, sizeof(entry->d_name), "%d", dir->cursor);
-        assert(res < sizeof(entry->d_name));
-        dir->cursor++;
-    }
-    else {
-        entry->d_type = DT_REG;
-        size_t strlcpy_res = strlcpy(entry->d_name, dir->fnames + dir->cursor, sizeof(entry->d_name));
-        assert(strlcpy_res < sizeof(entry->d_name));
-        dir->cursor += strlcpy_res + 1;
-    }
+    if(dir->has_stat) dir->cursor += LS_STAT_HEADER_LEN;
+
+    entry->d_type = DT_REG;
+    size_t strlcpy_res = strlcpy(entry->d_name, dir->fnames + dir->cursor, sizeof(entry->d_name));
+    assert(strlcpy_res < sizeof(entry->d_name));
+    dir->cursor += strlcpy_res + 1;
 
     return 0;
 }
@@ -524,24 +481,16 @@ static int op_unlink(FAR void *volinfo, FAR const char *relpath)
     if(*relpath == '\0') return -EPERM;
 
     const char * p = relpath;
-    int peer_id = decode_path(&p);
+    if(NULL != strchr(p, '/')) return -ENOENT;
 
-    if(peer_id < 0 || peer_id == vinfo->self_index) return -ENOENT;
-    if(*p == '\0') return -EPERM;
-
-    peer_t * peer = peer_id < vinfo->peer_count ? &vinfo->peers[peer_id] : NULL;
-    if(peer && peer->con != MCPD_CON_NULL) return -EBUSY;
+    if(vinfo->con != MCPD_CON_NULL) return -EBUSY;
 
     size_t filename_len = strlen(p);
     if(filename_len > 255) return -ENAMETOOLONG;
 
     mcpd_con_t con;
-    res = mcpd_connect(&con, peer_id);
+    res = mcpd_connect(&con, vinfo->peer_id);
     if(res == MCPD_DOESNT_EXIST) return -ENOENT;
-
-    peer = volinfo_ensure_peer(vinfo, peer_id);
-    peer->has_been_connected_to = true;
-
     if(res == MCPD_BUSY) return -EBUSY;
     assert(res == MCPD_OK);
 
@@ -555,6 +504,8 @@ static int op_unlink(FAR void *volinfo, FAR const char *relpath)
         return -ENOENT;
     }
 
+    vinfo->stat_dir = NULL;
+
     buf[0] = FS_BASE_ACTION_DELETE;
     buf[1] = filename_len;
     mcpd_write(con, buf, 2);
@@ -597,27 +548,11 @@ static int op_stat(FAR void *volinfo, FAR const char *relpath,
 {
     int res;
 
-    const char * p = relpath;
-    int peer_id = decode_path(&p);
-
-    bool is_peer_dir = peer_id >= 0 && *p == '\0';
-    bool is_dir = is_peer_dir || *relpath == '\0';
-
-    if(is_dir) {
-        if(is_peer_dir) {
-            volinfo_t * vinfo = volinfo;
-
-            if(peer_id == vinfo->self_index) return -ENOENT;
+    volinfo_t * vinfo = volinfo;
 
-            peer_t * peer = peer_id < vinfo->peer_count ? &vinfo->peers[peer_id] : NULL;
-            if(!peer || !peer->has_been_connected_to) {
-                if(!check_peer_is_present(peer_id)) {
-                    return -ENOENT;
-                }
-                peer = volinfo_ensure_peer(vinfo, peer_id);
-                peer->has_been_connected_to = true;
-            }
-        }
+    if(*relpath == '\0') {
+        /* the mount outlives the module being plugged in */
+        if(!check_peer_is_present(vinfo)) return -ENOENT;
 
         memset(buf, 0, sizeof(*buf));
         buf->st_mode = S_IFDIR | 0666;
@@ -625,6 +560,10 @@ static int op_stat(FAR void *volinfo, FAR const char *relpath,
         return 0;
     }
 
+    /* `ls -l` and the like stat every entry of the dir they have open.
+       The listing already has the answers. */
+    if(vinfo->stat_dir && dir_find_stat(vinfo->stat_dir, relpath, buf)) return 0;
+
     void * openinfo;
 
     res = op_open(volinfo, relpath, O_RDONLY, 0, &openinfo);
@@ -648,8 +587,7 @@ static int op_destroy(FAR void *volinfo)
     volinfo_t * vinfo = volinfo;
 
     assert(vinfo->open_dir_count == 0);
-    for(int i = 0; i < vinfo->peer_count; i++) assert(vinfo->peers[i].con == MCPD_CON_NULL);
-    free(vinfo->peers);
+    assert(vinfo->con == MCPD_CON_NULL);
 
     vinfo->was_destroyed = true;
     return 0;
@@ -693,111 +631,207 @@ static const struct userfs_operations_s ops = {
     op_chstat
 };
 
-int mcp_fs_main(int argc, char *argv[])
+static void * peer_thread(void * arg)
 {
-    volinfo_t vinfo = {
-        .peer_count = 0,
-        .self_index = -1,
-        .peers = NULL,
-        .was_destroyed = false
-    };
+    volinfo_t * vinfo = arg;
+    char mountpt[16];
+
+    snprintf(mountpt, sizeof(mountpt), MNT_MCP "%d", vinfo->peer_id);
+    int res = userfs_run(mountpt, &ops, vinfo, 0x4000);
+    if(!vinfo->was_destroyed) {
+        fprintf(stderr, "mcp_fs: userfs_run %s: %s\n", mountpt, strerror(-res));
+    }
 
-    userfs_run("/mnt/mcp", &ops, &vinfo, 0x4000);
-    assert(vinfo.was_destroyed);
+    assert(0 == pthread_mutex_lock(&mounted_mutex));
+    mounted[vinfo->peer_id] = MOUNT_NONE;
+    assert(0 == sem_post(&mount_ended[vinfo->peer_id]));
+    assert(0 == pthread_mutex_unlock(&mounted_mutex));
 
-    return 0;
+    free(vinfo);
+    return NULL;
+}
+
+static bool mount_confirm(int peer_id)
+{
+    char mountpt[16];
+    snprintf(mountpt, sizeof(mountpt), MNT_MCP "%d", peer_id);
+    bool present = 0 == access(mountpt, F_OK);
+
+    assert(0 == pthread_mutex_lock(&mounted_mutex));
+    if(present && mounted[peer_id] == MOUNT_PENDING) mounted[peer_id] = MOUNT_OK;
+    bool ok = mounted[peer_id] == MOUNT_OK;
+    assert(0 == pthread_mutex_unlock(&mounted_mutex));
+    return ok;
 }
 
-char * mcp_fs_cache_file(const char * file_path)
+/* returns true once the peer's mount is usable */
+static bool mount_peer(int peer_id)
 {
     int res;
-    ssize_t rwres;
 
-    struct stat st;
+    assert(0 == pthread_mutex_lock(&mounted_mutex));
+    mount_state_t state = mounted[peer_id];
+    if(state == MOUNT_NONE) mounted[peer_id] = MOUNT_PENDING;
+    assert(0 == pthread_mutex_unlock(&mounted_mutex));
+    /* a module that was unplugged and plugged back in keeps its mount */
+    if(state == MOUNT_OK) return true;
+    if(state == MOUNT_PENDING) return mount_confirm(peer_id);
+
+    /* left over from the thread of an earlier mount */
+    while(0 == sem_trywait(&mount_ended[peer_id]));
+
+    volinfo_t * vinfo = calloc(1, sizeof(volinfo_t));
+    assert(vinfo);
+    vinfo->peer_id = peer_id;
+    vinfo->con = MCPD_CON_NULL;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    res = pthread_attr_init(&attr);
+    assert(res == 0);
+
+    res = pthread_attr_setstacksize(&attr, CONFIG_MCP_APPS_MCP_FS_PEER_STACKSIZE);
+    assert(res == 0);
+
+    res = pthread_create(&thread, &attr, peer_thread, vinfo);
+    assert(res == 0);
 
-    char * ret = NULL;
+    res = pthread_detach(thread);
+    assert(res == 0);
 
-    char * fullpath = NULL;
-    sem_t * sem = SEM_FAILED;
+    res = pthread_attr_destroy(&attr);
+    assert(res == 0);
 
-    fullpath = realpath(file_path, NULL);
-    if(fullpath == NULL) goto free_ret;
-    size_t fullpath_len = strlen(fullpath);
-    if(fullpath_len < sizeof(MNT_MCP) - 1
-       || 0 != memcmp(fullpath, MNT_MCP, sizeof(MNT_MCP) - 1)) {
-        goto free_ret;
+    /* userfs_run mounts it from the new thread and then serves it until
+       it's unmounted. It returns straight away if the mount fails and
+       doesn't block before, so if it hasn't returned after a short wait
+       the mount is there. */
+    struct timespec deadline;
+    res = clock_gettime(CLOCK_REALTIME, &deadline);
+    assert(res == 0);
+    deadline.tv_nsec += MOUNT_WAIT_MS * 1000000L;
+    if(deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
     }
+    while(0 != (res = sem_timedwait(&mount_ended[peer_id], &deadline)) && errno == EINTR);
+    if(res == 0) return false;
+    assert(errno == ETIMEDOUT);
 
-    const char * p = fullpath + (sizeof(MNT_MCP) - 1);
-    int peer_id = decode_path(&p);
-    if(peer_id < 0) goto free_ret;
+    /* a mount that is still on its way is looked for again the next
+       time the module arrives */
+    return mount_confirm(peer_id);
+}
 
-    mcpd_con_t con;
-    res = mcpd_connect(&con, peer_id);
-    if(res) goto free_ret;
-    uint8_t hash[32];
-    res = mcpd_file_hash(con, p, hash);
-    mcpd_disconnect(con);
-    if(res) goto free_ret;
+static mqd_t ready_queue_inner_open(int oflag)
+{
+    struct mq_attr attr = {.mq_maxmsg = READY_QUEUE_LEN, .mq_msgsize = sizeof(uint8_t)};
+    mqd_t q = mq_open(READY_QUEUE_NAME, oflag, 0666, &attr);
+    assert(q != -1);
+    return q;
+}
 
-    char cachepath[(sizeof(MNT_CACHE) - 1) + 64 + 1];
-    memcpy(cachepath, MNT_CACHE, sizeof(MNT_CACHE) - 1);
-    raw_to_hex(cachepath + (sizeof(MNT_CACHE) - 1), hash, 32);
-    cachepath[sizeof(cachepath) - 1] = '\0';
+mcp_fs_ready_t mcp_fs_ready_open(void)
+{
+    return ready_queue_inner_open(O_RDONLY | O_CREAT);
+}
 
-    char * hash_hex = cachepath + (sizeof(MNT_CACHE) - 1);
+int mcp_fs_ready_wait(mcp_fs_ready_t mq)
+{
+    uint8_t peer_id;
+    ssize_t rwres = mq_receive(mq, (char *) &peer_id, sizeof(peer_id), NULL);
+    assert(rwres == sizeof(peer_id));
+    return peer_id;
+}
 
-    sem = sem_open(hash_hex, O_CREAT, 0666, 1);
-    assert(sem != SEM_FAILED);
-    res = sem_wait(sem);
+void mcp_fs_ready_close(mcp_fs_ready_t mq)
+{
+    int res = mq_close(mq);
     assert(res == 0);
+}
 
-    res = stat(cachepath, &st);
-    if(res == 0 && (st.st_size != 0
-                    || 0 == memcmp(hash, sha256_emptyfile, 32))) {
-        goto success_post_free_ret;
+/* Nobody may be reading, e.g. without mcp_init, so a full queue drops
+   the announcement instead of holding up the next module's mount. */
+void mcp_fs_ready_announce(int peer_id)
+{
+    uint8_t msg = peer_id;
+    if(0 != mq_send(ready_mq, (const char *) &msg, sizeof(msg), 10)) {
+        assert(errno == EAGAIN);
+        fprintf(stderr, "mcp_fs: nobody is taking ready modules, %d dropped\n", peer_id);
     }
-    assert(res == 0 || errno == ENOENT);
+}
+
+static void show_usage(void)
+{
+    fprintf(stderr, "usage: mcp_fs [-s]\n");
+}
+
+static void print_cache_stats(void)
+{
+    mcp_fs_cache_stats_t stats;
+    mcp_fs_cache_get_stats(&stats);
+
+    printf("hits %"PRIu32"\n", stats.hits);
+    printf("misses %"PRIu32"\n", stats.misses);
+    printf("evictions %"PRIu32"\n", stats.evictions);
+    printf("evicted_bytes %"PRIu32"\n", stats.evicted_bytes);
+    printf("revalidations %"PRIu32"\n", stats.revalidations);
+    printf("delta_fills %"PRIu32"\n", stats.delta_fills);
+    printf("delta_saved_bytes %"PRIu32"\n", stats.delta_saved_bytes);
+    printf("used_bytes %"PRIu32"\n", stats.used_bytes);
+    printf("budget_bytes %"PRIu32"\n", stats.budget_bytes);
+}
 
-    int cfd = open(cachepath, O_WRONLY | O_CREAT, 0666);
-    if(cfd < 0) goto post_free_ret;
+int mcp_fs_main(int argc, char *argv[])
+{
+    int res;
+    bool print_stats = false;
+    int opt;
+    while((opt = getopt(argc, argv, "s")) >= 0) {
+        if(opt == 's') print_stats = true;
+        else {
+            show_usage();
+            return 1;
+        }
+    }
 
-    int mfd = open(file_path, O_RDONLY);
-    if(mfd < 0) {
-        close(cfd);
-        unlink(cachepath);
-        goto post_free_ret;
+    if(print_stats) {
+        print_cache_stats();
+        return 0;
     }
 
-    res = fstat(mfd, &st);
-    assert(res == 0); /* should not fail */
-    ssize_t mfile_size = st.st_size;
-    assert(mfile_size >= 0);
-
-    rwres = sendfile(cfd, mfd, NULL, mfile_size);
-    assert(0 == close(mfd));
-    if(rwres != mfile_size) {
-        assert(0 == ftruncate(cfd, 0));
-        close(cfd);
-        unlink(cachepath);
-        goto post_free_ret;
+    for(int i = 0; i < sizeof(mount_ended) / sizeof(*mount_ended); i++) {
+        res = sem_init(&mount_ended[i], 0, 0);
+        assert(res == 0);
     }
 
-    res = close(cfd);
-    if(res) {
-        unlink(cachepath);
-        goto post_free_ret;
+    /* so the listing works before the first module arrives */
+    res = mkdir(MNT_MCP_DIR, 0777);
+    assert(res == 0 || errno == EEXIST);
+
+    ready_mq = ready_queue_inner_open(O_WRONLY | O_CREAT | O_NONBLOCK);
+    mcp_fs_cache_reconcile();
+    mcp_fs_prefetch_start();
+
+    mcpd_watch_t watch = mcpd_watch_create();
+
+    while(1) {
+        int peer = mcpd_watch_wait(watch);
+        assert(peer >= 0);
+
+        if(mount_peer(peer)) {
+            /* announced and its files prefetched */
+            mcp_fs_prefetch_peer(peer);
+        }
+        else {
+            fprintf(stderr, "mcp_fs: " MNT_MCP "%d didn't mount\n", peer);
+        }
     }
 
-success_post_free_ret:
-    ret = strdup(cachepath);
-    assert(ret);
-post_free_ret:
-    assert(0 == sem_post(sem));
-free_ret:
-    free(fullpath);
-    if(sem != SEM_FAILED) assert(0 == sem_close(sem));
-    return ret;
+    /* mcpd_watch_destroy(watch); */
+
+    return 0;
 }
 
 int mcp_fs_path_get_peer_id(const char * file_path)
@@ -806,5 +840,5 @@ int mcp_fs_path_get_peer_id(const char * file_path)
     if(len < (sizeof(MNT_MCP) - 1)
        || 0 != memcmp(file_path, MNT_MCP, sizeof(MNT_MCP) - 1)) return -1;
     const char * vol_path = file_path + (sizeof(MNT_MCP) - 1);
-    return decode_path(&vol_path);
+    return mcp_fs_util_decode_path(&vol_path);
 }
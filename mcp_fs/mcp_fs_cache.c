@@ -0,0 +1,838 @@
+#include <nuttx/config.h>
+
+#include <mcp/mcp_fs.h>
+#include <mcp/mcpd.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <semaphore.h>
+#include <sys/stat.h>
+
+#include "mcp_fs_private.h"
+
+#define CACHE_LOCK_NAME "mcp_fs_cache"
+#define CACHE_STATS_PATH "/tmp/mcp_fs_cache_stats"
+#define HASH_HEX_LEN 64
+#define TMP_SUFFIX ".tmp"
+#define SIBLING_SUFFIX_MAX 48
+#define CACHE_NAME_MAX (HASH_HEX_LEN + SIBLING_SUFFIX_MAX)
+#define CACHE_PATH_MAX ((sizeof(MNT_CACHE) - 1) + CACHE_NAME_MAX + 1)
+#define HASHMAP_PATH MNT_CACHE "hashmap"
+#define HASHMAP_MAX_ENTRIES 64
+#define HASHMAP_REC_HEADER_LEN (8 + 4 + 32 + 1) /* uid, generation, hash, name len */
+#define LRU_PATH MNT_CACHE "lru"
+#define LRU_MAX_ENTRIES 256
+#define BUSY_RETRY_FIRST_US 5000
+#define BUSY_RETRY_MAX_US 200000
+#define BUSY_RETRY_COUNT 12
+
+typedef struct {
+    char name[CACHE_NAME_MAX + 1];
+    off_t size;
+    int rank; /* position in the LRU list, -1 if it isn't in it */
+} cache_ent_t;
+
+typedef struct {
+    unsigned hits;
+    unsigned misses;
+    unsigned evictions;
+    unsigned evicted_bytes;
+    unsigned revalidations;
+    unsigned delta_fills;
+    unsigned delta_saved_bytes;
+} cache_counters_t;
+
+typedef struct {
+    const uint8_t * uid;
+    uint32_t generation;
+    const uint8_t * hash;
+    const char * name;
+    uint8_t name_len;
+    size_t len;
+} hashmap_rec_t;
+
+static const uint8_t sha256_emptyfile[32] = {
+    0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14,
+    0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+    0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c,
+    0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55
+};
+
+static void raw_to_hex(char * dst, const uint8_t * src, size_t len) {
+    for(size_t i = 0; i < len; i++) {
+        char buf[3];
+        sprintf(buf, "%02x", (unsigned) src[i]);
+        dst[i*2] = buf[0];
+        dst[i*2 + 1] = buf[1];
+    }
+}
+
+static bool is_hash_hex(const char * name)
+{
+    for(int i = 0; i < HASH_HEX_LEN; i++) {
+        char c = name[i];
+        if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+    }
+    return true;
+}
+
+/* `suffix` is the part of the name after the hash, "" or TMP_SUFFIX */
+static bool is_cache_name(const char * name, const char * suffix)
+{
+    return is_hash_hex(name) && 0 == strcmp(name + HASH_HEX_LEN, suffix);
+}
+
+/* Other apps keep files derived from an entry next to it, named the
+   entry's hash plus a "." suffix, e.g. mcp_forth's compiled programs.
+   They count towards the budget and are evicted in their own right. */
+static bool is_sibling_name(const char * name)
+{
+    if(!is_hash_hex(name) || name[HASH_HEX_LEN] != '.') return false;
+    size_t suffix_len = strlen(name + HASH_HEX_LEN);
+    return suffix_len <= SIBLING_SUFFIX_MAX && 0 != strcmp(name + HASH_HEX_LEN, TMP_SUFFIX);
+}
+
+static bool has_tmp_suffix(const char * name)
+{
+    size_t len = strlen(name);
+    return len >= sizeof(TMP_SUFFIX) - 1
+           && 0 == strcmp(name + len - (sizeof(TMP_SUFFIX) - 1), TMP_SUFFIX);
+}
+
+static void cache_path(char * dst, const char * name)
+{
+    int res = snprintf(dst, CACHE_PATH_MAX, MNT_CACHE "%s", name);
+    assert(res > 0 && res < CACHE_PATH_MAX);
+}
+
+/* the cache lock guards the directory listing, the counters, and
+   the creation and removal of the per-hash fill semaphores */
+static sem_t * cache_lock(void)
+{
+    int res;
+
+    sem_t * sem = sem_open(CACHE_LOCK_NAME, O_CREAT, 0666, 1);
+    assert(sem != SEM_FAILED);
+    res = sem_wait(sem);
+    assert(res == 0);
+
+    return sem;
+}
+
+static void cache_unlock(sem_t * sem)
+{
+    int res;
+
+    res = sem_post(sem);
+    assert(res == 0);
+    res = sem_close(sem);
+    assert(res == 0);
+}
+
+/* a fill semaphore only exists while some caller is filling or waiting
+   to fill an entry so its presence means the entry is in use */
+static bool cache_ent_is_in_use(const char * hash_hex)
+{
+    sem_t * sem = sem_open(hash_hex, 0);
+    if(sem == SEM_FAILED) return false;
+    assert(0 == sem_close(sem));
+    return true;
+}
+
+static bool cache_ent_is_valid(const char * cachepath, const uint8_t * hash)
+{
+    struct stat st;
+    int res = stat(cachepath, &st);
+    if(res < 0) {
+        assert(errno == ENOENT);
+        return false;
+    }
+    /* a zero-length entry is left over from before fills were renamed
+       into place unless the module file is really empty */
+    return st.st_size != 0 || 0 == memcmp(hash, sha256_emptyfile, 32);
+}
+
+static void cache_counters_read(cache_counters_t * counters)
+{
+    memset(counters, 0, sizeof(*counters));
+
+    FILE * f = fopen(CACHE_STATS_PATH, "r");
+    if(f == NULL) return;
+    if(7 != fscanf(f, "%u %u %u %u %u %u %u", &counters->hits, &counters->misses,
+                   &counters->evictions, &counters->evicted_bytes,
+                   &counters->revalidations, &counters->delta_fills,
+                   &counters->delta_saved_bytes)) {
+        memset(counters, 0, sizeof(*counters));
+    }
+    assert(0 == fclose(f));
+}
+
+/* call with the cache lock held */
+static void cache_counters_add(const cache_counters_t * delta)
+{
+    cache_counters_t counters;
+
+    if(!delta->hits && !delta->misses && !delta->evictions && !delta->revalidations) return;
+
+    cache_counters_read(&counters);
+    counters.hits += delta->hits;
+    counters.misses += delta->misses;
+    counters.evictions += delta->evictions;
+    counters.evicted_bytes += delta->evicted_bytes;
+    counters.revalidations += delta->revalidations;
+    counters.delta_fills += delta->delta_fills;
+    counters.delta_saved_bytes += delta->delta_saved_bytes;
+
+    FILE * f = fopen(CACHE_STATS_PATH, "w");
+    if(f == NULL) return;
+    fprintf(f, "%u %u %u %u %u %u %u\n", counters.hits, counters.misses,
+            counters.evictions, counters.evicted_bytes, counters.revalidations,
+            counters.delta_fills, counters.delta_saved_bytes);
+    assert(0 == fclose(f));
+}
+
+static uint8_t * file_read_all(const char * path, size_t * len_dst)
+{
+    ssize_t rwres;
+
+    *len_dst = 0;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    assert(0 == fstat(fd, &st));
+
+    uint8_t * buf = malloc(st.st_size ? st.st_size : 1);
+    assert(buf);
+    rwres = read(fd, buf, st.st_size);
+    assert(0 == close(fd));
+    if(rwres != st.st_size) {
+        free(buf);
+        return NULL;
+    }
+
+    *len_dst = st.st_size;
+    return buf;
+}
+
+static bool hashmap_rec_parse(const uint8_t * p, size_t remaining, hashmap_rec_t * rec)
+{
+    if(remaining < HASHMAP_REC_HEADER_LEN) return false;
+    rec->uid = p;
+    memcpy(&rec->generation, p + 8, 4);
+    rec->hash = p + 12;
+    rec->name_len = p[44];
+    rec->name = (const char *) p + HASHMAP_REC_HEADER_LEN;
+    rec->len = HASHMAP_REC_HEADER_LEN + rec->name_len;
+    return rec->len <= remaining;
+}
+
+static bool hashmap_rec_is_for(const hashmap_rec_t * rec, const uint8_t * uid, const char * name)
+{
+    return 0 == memcmp(rec->uid, uid, 8)
+           && rec->name_len == strlen(name)
+           && 0 == memcmp(rec->name, name, rec->name_len);
+}
+
+/* call with the cache lock held */
+static bool hashmap_lookup(const uint8_t * uid, const char * name, uint32_t generation,
+                           uint8_t * hash_dst, uint8_t * prev_hash_dst, bool * has_prev_dst)
+{
+    bool found = false;
+    size_t len;
+    uint8_t * buf = file_read_all(HASHMAP_PATH, &len);
+
+    hashmap_rec_t rec;
+    for(size_t pos = 0; hashmap_rec_parse(buf + pos, len - pos, &rec); pos += rec.len) {
+        if(!hashmap_rec_is_for(&rec, uid, name)) continue;
+        if(rec.generation == generation) {
+            memcpy(hash_dst, rec.hash, 32);
+            found = true;
+        } else {
+            /* an older version we may still have cached */
+            memcpy(prev_hash_dst, rec.hash, 32);
+            *has_prev_dst = true;
+        }
+        break;
+    }
+
+    free(buf);
+    return found;
+}
+
+/* Replace the record for (uid, name) or add one. The oldest records are
+   dropped past HASHMAP_MAX_ENTRIES. Call with the cache lock held. */
+static void hashmap_store(const uint8_t * uid, const char * name, uint32_t generation,
+                          const uint8_t * hash)
+{
+    ssize_t rwres;
+
+    size_t len;
+    uint8_t * buf = file_read_all(HASHMAP_PATH, &len);
+
+    int count = 0;
+    hashmap_rec_t rec;
+    for(size_t pos = 0; hashmap_rec_parse(buf + pos, len - pos, &rec); pos += rec.len) {
+        if(!hashmap_rec_is_for(&rec, uid, name)) count++;
+    }
+
+    int fd = open(HASHMAP_PATH TMP_SUFFIX, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) {
+        free(buf);
+        return;
+    }
+
+    bool ok = true;
+    int skip = count - (HASHMAP_MAX_ENTRIES - 1);
+    for(size_t pos = 0; hashmap_rec_parse(buf + pos, len - pos, &rec); pos += rec.len) {
+        if(hashmap_rec_is_for(&rec, uid, name)) continue;
+        if(skip-- > 0) continue;
+        rwres = write(fd, buf + pos, rec.len);
+        ok = ok && rwres == rec.len;
+    }
+    free(buf);
+
+    uint8_t header[HASHMAP_REC_HEADER_LEN];
+    memcpy(header, uid, 8);
+    memcpy(header + 8, &generation, 4);
+    memcpy(header + 12, hash, 32);
+    header[44] = strlen(name);
+    rwres = write(fd, header, sizeof(header));
+    ok = ok && rwres == sizeof(header);
+    rwres = write(fd, name, header[44]);
+    ok = ok && rwres == header[44];
+
+    ok = 0 == close(fd) && ok;
+    if(!ok || 0 != rename(HASHMAP_PATH TMP_SUFFIX, HASHMAP_PATH)) {
+        unlink(HASHMAP_PATH TMP_SUFFIX);
+    }
+}
+
+/* The LRU list is the cache names, one per line, least recently used
+   first. It is kept in a file of its own rather than in mtimes, which
+   not every file system keeps and which only have second resolution. */
+
+static int lru_rank(const char * buf, size_t len, const char * name)
+{
+    size_t name_len = strlen(name);
+    int rank = -1;
+    int i = 0;
+    for(size_t pos = 0; pos < len; i++) {
+        const char * nl = memchr(buf + pos, '\n', len - pos);
+        size_t line_len = nl ? nl - (buf + pos) : len - pos;
+        if(line_len == name_len && 0 == memcmp(buf + pos, name, name_len)) rank = i;
+        pos += line_len + 1;
+    }
+    return rank;
+}
+
+/* Move `name` to the most recently used end, dropping the least recently
+   used names past LRU_MAX_ENTRIES. Call with the cache lock held. */
+static void lru_touch(const char * name)
+{
+    ssize_t rwres;
+
+    size_t len;
+    char * buf = (char *) file_read_all(LRU_PATH, &len);
+    size_t name_len = strlen(name);
+
+    int count = 0;
+    for(size_t pos = 0; pos < len; ) {
+        const char * nl = memchr(buf + pos, '\n', len - pos);
+        size_t line_len = nl ? nl - (buf + pos) : len - pos;
+        bool is_name = line_len == name_len && 0 == memcmp(buf + pos, name, name_len);
+        if(!is_name && nl && line_len) count++;
+        pos += line_len + 1;
+    }
+
+    int fd = open(LRU_PATH TMP_SUFFIX, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) {
+        free(buf);
+        return;
+    }
+
+    bool ok = true;
+    int skip = count - (LRU_MAX_ENTRIES - 1);
+    for(size_t pos = 0; pos < len; ) {
+        const char * nl = memchr(buf + pos, '\n', len - pos);
+        size_t line_len = nl ? nl - (buf + pos) : len - pos;
+        bool is_name = line_len == name_len && 0 == memcmp(buf + pos, name, name_len);
+        if(!is_name && nl && line_len && skip-- <= 0) {
+            rwres = write(fd, buf + pos, line_len + 1);
+            ok = ok && rwres == line_len + 1;
+        }
+        pos += line_len + 1;
+    }
+    free(buf);
+
+    rwres = write(fd, name, name_len);
+    ok = ok && rwres == name_len;
+    rwres = write(fd, "\n", 1);
+    ok = ok && rwres == 1;
+
+    ok = 0 == close(fd) && ok;
+    if(!ok || 0 != rename(LRU_PATH TMP_SUFFIX, LRU_PATH)) {
+        unlink(LRU_PATH TMP_SUFFIX);
+    }
+}
+
+/* A module serves one connection at a time so a prefetch or another
+   loader may briefly hold it. Back off and retry instead of failing. */
+int mcp_fs_util_connect(mcpd_con_t * con_dst, int peer_id)
+{
+    int res;
+    useconds_t delay = BUSY_RETRY_FIRST_US;
+
+    for(int i = 0; ; i++) {
+        res = mcpd_connect(con_dst, peer_id);
+        if(res != MCPD_BUSY || i == BUSY_RETRY_COUNT) return res;
+        usleep(delay);
+        if(delay < BUSY_RETRY_MAX_US) delay *= 2;
+    }
+}
+
+/* Ask the module for the file's generation first. If it hasn't changed
+   since the file was last hashed, the hash in the map is still right
+   and the module doesn't need to hash the whole file again.
+   If it has changed, `prev_hash_dst` is the hash of the version before. */
+static int cache_file_hash(int peer_id, const char * file_name, uint8_t * hash_dst,
+                           uint8_t * prev_hash_dst, bool * has_prev_dst,
+                           cache_counters_t * counters)
+{
+    int res;
+    mcpd_con_t con;
+    sem_t * lock;
+
+    uint8_t uid[8];
+    uint32_t generation;
+
+    *has_prev_dst = false;
+
+    res = mcp_fs_util_connect(&con, peer_id);
+    if(res) return res;
+    int generation_res = mcpd_file_generation(con, file_name, uid, &generation);
+    mcpd_disconnect(con);
+
+    if(generation_res == MCPD_OK) {
+        lock = cache_lock();
+        bool found = hashmap_lookup(uid, file_name, generation, hash_dst,
+                                    prev_hash_dst, has_prev_dst);
+        cache_unlock(lock);
+        if(found) {
+            counters->revalidations++;
+            return MCPD_OK;
+        }
+    }
+
+    /* the generation is queried before the hash so if the file changes
+       in between, the stale generation is mapped and never matches again */
+    res = mcp_fs_util_connect(&con, peer_id);
+    if(res) return res;
+    res = mcpd_file_hash(con, file_name, hash_dst);
+    mcpd_disconnect(con);
+    if(res) return res;
+
+    if(generation_res == MCPD_OK) {
+        lock = cache_lock();
+        hashmap_store(uid, file_name, generation, hash_dst);
+        cache_unlock(lock);
+    }
+
+    return MCPD_OK;
+}
+
+/* call with the cache lock held */
+static cache_ent_t * cache_scan(int * count_dst, off_t * total_dst)
+{
+    int res;
+
+    cache_ent_t * ents = NULL;
+    int count = 0;
+    off_t total = 0;
+
+    size_t lru_len;
+    char * lru = (char *) file_read_all(LRU_PATH, &lru_len);
+
+    DIR * dir = opendir(MNT_CACHE);
+    if(dir) {
+        struct dirent * de;
+        while((de = readdir(dir))) {
+            if(!is_cache_name(de->d_name, "")
+               && (!is_sibling_name(de->d_name) || has_tmp_suffix(de->d_name))) continue;
+
+            char path[CACHE_PATH_MAX];
+            cache_path(path, de->d_name);
+            struct stat st;
+            res = stat(path, &st);
+            if(res < 0) continue;
+
+            ents = realloc(ents, ++count * sizeof(*ents));
+            assert(ents);
+            cache_ent_t * ent = &ents[count - 1];
+            strcpy(ent->name, de->d_name);
+            ent->size = st.st_size;
+            ent->rank = lru_rank(lru, lru_len, de->d_name);
+            total += st.st_size;
+        }
+        assert(0 == closedir(dir));
+    }
+    free(lru);
+
+    *count_dst = count;
+    *total_dst = total;
+    return ents;
+}
+
+static int cache_ent_compare_rank(const void * a, const void * b)
+{
+    const cache_ent_t * ea = a;
+    const cache_ent_t * eb = b;
+    return ea->rank < eb->rank ? -1 : ea->rank > eb->rank;
+}
+
+/* Evict least recently used entries until `reserve` more bytes fit in the
+   budget. `keep_hash_hex` is never evicted. Call with the cache lock held. */
+static void cache_evict(const char * keep_hash_hex, off_t reserve, cache_counters_t * counters)
+{
+#if CONFIG_MCP_APPS_MCP_FS_CACHE_SIZE
+    int count;
+    off_t total;
+    cache_ent_t * ents = cache_scan(&count, &total);
+
+    if(total + reserve > CONFIG_MCP_APPS_MCP_FS_CACHE_SIZE) {
+        qsort(ents, count, sizeof(*ents), cache_ent_compare_rank);
+
+        for(int i = 0; i < count && total + reserve > CONFIG_MCP_APPS_MCP_FS_CACHE_SIZE; i++) {
+            cache_ent_t * ent = &ents[i];
+            if(keep_hash_hex && 0 == memcmp(ent->name, keep_hash_hex, HASH_HEX_LEN)) continue;
+            char hash_hex[HASH_HEX_LEN + 1];
+            memcpy(hash_hex, ent->name, HASH_HEX_LEN);
+            hash_hex[HASH_HEX_LEN] = '\0';
+            if(cache_ent_is_in_use(hash_hex)) continue;
+
+            char path[CACHE_PATH_MAX];
+            cache_path(path, ent->name);
+            if(unlink(path) < 0) continue;
+
+            total -= ent->size;
+            counters->evictions++;
+            counters->evicted_bytes += ent->size;
+        }
+    }
+
+    free(ents);
+#endif
+}
+
+void mcp_fs_cache_reconcile(void)
+{
+    int res;
+
+    cache_counters_t counters;
+    memset(&counters, 0, sizeof(counters));
+
+    char emptyfile_hex[HASH_HEX_LEN + 1];
+    raw_to_hex(emptyfile_hex, sha256_emptyfile, 32);
+    emptyfile_hex[HASH_HEX_LEN] = '\0';
+
+    sem_t * lock = cache_lock();
+
+    /* collect names first so the directory is not modified while it's read */
+    char (* doomed)[CACHE_NAME_MAX + 1] = NULL;
+    int doomed_count = 0;
+
+    DIR * dir = opendir(MNT_CACHE);
+    if(dir) {
+        struct dirent * de;
+        while((de = readdir(dir))) {
+            /* siblings are only cleaned up if they were left half written */
+            bool is_sibling = is_sibling_name(de->d_name);
+            if(is_sibling && !has_tmp_suffix(de->d_name)) continue;
+            bool is_tmp = is_sibling || is_cache_name(de->d_name, TMP_SUFFIX);
+            if(!is_tmp && !is_cache_name(de->d_name, "")) continue;
+
+            char hash_hex[HASH_HEX_LEN + 1];
+            memcpy(hash_hex, de->d_name, HASH_HEX_LEN);
+            hash_hex[HASH_HEX_LEN] = '\0';
+            if(cache_ent_is_in_use(hash_hex)) continue;
+
+            if(!is_tmp) {
+                char path[CACHE_PATH_MAX];
+                cache_path(path, de->d_name);
+                struct stat st;
+                res = stat(path, &st);
+                if(res < 0 || st.st_size != 0
+                   || 0 == strcmp(hash_hex, emptyfile_hex)) continue;
+            }
+
+            doomed = realloc(doomed, ++doomed_count * sizeof(*doomed));
+            assert(doomed);
+            strcpy(doomed[doomed_count - 1], de->d_name);
+        }
+        assert(0 == closedir(dir));
+    }
+
+    for(int i = 0; i < doomed_count; i++) {
+        char path[CACHE_PATH_MAX];
+        cache_path(path, doomed[i]);
+        unlink(path);
+    }
+    free(doomed);
+
+    cache_evict(NULL, 0, &counters);
+    cache_counters_add(&counters);
+
+    cache_unlock(lock);
+}
+
+void mcp_fs_cache_get_stats(mcp_fs_cache_stats_t * stats_dst)
+{
+    cache_counters_t counters;
+    int count;
+    off_t total;
+
+    sem_t * lock = cache_lock();
+    cache_counters_read(&counters);
+    free(cache_scan(&count, &total));
+    cache_unlock(lock);
+
+    stats_dst->hits = counters.hits;
+    stats_dst->misses = counters.misses;
+    stats_dst->evictions = counters.evictions;
+    stats_dst->evicted_bytes = counters.evicted_bytes;
+    stats_dst->revalidations = counters.revalidations;
+    stats_dst->delta_fills = counters.delta_fills;
+    stats_dst->delta_saved_bytes = counters.delta_saved_bytes;
+    stats_dst->used_bytes = total;
+    stats_dst->budget_bytes = CONFIG_MCP_APPS_MCP_FS_CACHE_SIZE;
+}
+
+void mcp_fs_cache_touch(const char * cachepath)
+{
+    size_t len = strlen(cachepath);
+    if(len <= sizeof(MNT_CACHE) - 1 || 0 != memcmp(cachepath, MNT_CACHE, sizeof(MNT_CACHE) - 1)) {
+        return;
+    }
+    const char * name = cachepath + (sizeof(MNT_CACHE) - 1);
+    if(!is_cache_name(name, "") && !is_sibling_name(name)) return;
+
+    sem_t * lock = cache_lock();
+    lru_touch(name);
+    cache_unlock(lock);
+}
+
+/* The resolved path of a module file, with `p_dst` pointing at its name
+   on the module, or NULL if it isn't one. */
+static char * module_file_path(const char * file_path, int * peer_id_dst, const char ** p_dst)
+{
+    char * fullpath = realpath(file_path, NULL);
+    if(fullpath == NULL) return NULL;
+    size_t fullpath_len = strlen(fullpath);
+    if(fullpath_len < sizeof(MNT_MCP) - 1
+       || 0 != memcmp(fullpath, MNT_MCP, sizeof(MNT_MCP) - 1)) {
+        free(fullpath);
+        return NULL;
+    }
+
+    const char * p = fullpath + (sizeof(MNT_MCP) - 1);
+    int peer_id = mcp_fs_util_decode_path(&p);
+    if(peer_id < 0) {
+        free(fullpath);
+        return NULL;
+    }
+
+    *peer_id_dst = peer_id;
+    *p_dst = p;
+    return fullpath;
+}
+
+/* `fd_dst` is NULL or gets the entry opened while it can't be evicted */
+static char * cache_file(const char * file_path, int * fd_dst)
+{
+    int res;
+    ssize_t rwres;
+
+    char * ret = NULL;
+    int fd = -1;
+
+    sem_t * sem;
+    sem_t * lock;
+
+    cache_counters_t counters;
+    memset(&counters, 0, sizeof(counters));
+
+    int peer_id;
+    const char * p;
+    char * fullpath = module_file_path(file_path, &peer_id, &p);
+    if(fullpath == NULL) goto free_ret;
+
+    uint8_t hash[32];
+    uint8_t prev_hash[32];
+    bool has_prev;
+    res = cache_file_hash(peer_id, p, hash, prev_hash, &has_prev, &counters);
+    if(res) goto free_ret;
+
+    char cachepath[CACHE_PATH_MAX];
+    memcpy(cachepath, MNT_CACHE, sizeof(MNT_CACHE) - 1);
+    raw_to_hex(cachepath + (sizeof(MNT_CACHE) - 1), hash, 32);
+    cachepath[(sizeof(MNT_CACHE) - 1) + HASH_HEX_LEN] = '\0';
+
+    char * hash_hex = cachepath + (sizeof(MNT_CACHE) - 1);
+
+    lock = cache_lock();
+    if(cache_ent_is_valid(cachepath, hash)) {
+        if(fd_dst) fd = open(cachepath, O_RDONLY);
+        if(fd_dst == NULL || fd >= 0) {
+            counters.hits++;
+            lru_touch(hash_hex);
+            ret = strdup(cachepath);
+            assert(ret);
+        }
+        cache_counters_add(&counters);
+        cache_unlock(lock);
+        goto free_ret;
+    }
+    counters.misses++;
+    sem = sem_open(hash_hex, O_CREAT, 0666, 1);
+    assert(sem != SEM_FAILED);
+    cache_unlock(lock);
+
+    res = sem_wait(sem);
+    assert(res == 0);
+
+    /* another caller may have filled it while we were waiting */
+    if(cache_ent_is_valid(cachepath, hash)) {
+        goto success_post_free_ret;
+    }
+
+    /* a small edit to a file we have the previous version of only
+       needs the changed blocks */
+    mcpd_con_t mcon = MCPD_CON_NULL;
+    uint32_t mfile_size;
+    size_t delta_transferred;
+    uint8_t * delta = NULL;
+    if(has_prev) {
+        char prevpath[CACHE_PATH_MAX];
+        memcpy(prevpath, MNT_CACHE, sizeof(MNT_CACHE) - 1);
+        raw_to_hex(prevpath + (sizeof(MNT_CACHE) - 1), prev_hash, 32);
+        prevpath[(sizeof(MNT_CACHE) - 1) + HASH_HEX_LEN] = '\0';
+        size_t delta_len;
+        delta = mcp_fs_delta_fetch(peer_id, p, prevpath, &delta_len, &delta_transferred);
+        mfile_size = delta_len;
+    }
+
+    if(delta == NULL) {
+        res = mcp_fs_direct_open(peer_id, p, &mcon, &mfile_size);
+        if(res) goto post_free_ret;
+    }
+
+    lock = cache_lock();
+    cache_evict(hash_hex, mfile_size, &counters);
+    cache_unlock(lock);
+
+    char tmppath[CACHE_PATH_MAX];
+    res = snprintf(tmppath, sizeof(tmppath), "%s" TMP_SUFFIX, cachepath);
+    assert(res > 0 && res < sizeof(tmppath));
+
+    int cfd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if(cfd < 0) {
+        if(delta) free(delta);
+        else mcp_fs_direct_close(mcon);
+        goto post_free_ret;
+    }
+
+    bool ok;
+    if(delta) {
+        rwres = write(cfd, delta, mfile_size);
+        ok = rwres == mfile_size;
+        free(delta);
+    } else {
+        ok = mcp_fs_direct_read_to_fd(mcon, cfd, mfile_size);
+        mcp_fs_direct_close(mcon);
+    }
+    res = close(cfd);
+    if(!ok || res) {
+        unlink(tmppath);
+        goto post_free_ret;
+    }
+    if(delta) {
+        counters.delta_fills++;
+        counters.delta_saved_bytes += mfile_size - delta_transferred;
+    }
+
+    res = unlink(cachepath); /* a stale zero-length entry */
+    assert(res == 0 || errno == ENOENT);
+    res = rename(tmppath, cachepath);
+    if(res) {
+        unlink(tmppath);
+        goto post_free_ret;
+    }
+
+success_post_free_ret:
+    /* the fill semaphore still keeps it from being evicted */
+    if(fd_dst) fd = open(cachepath, O_RDONLY);
+    if(fd_dst == NULL || fd >= 0) {
+        ret = strdup(cachepath);
+        assert(ret);
+    }
+post_free_ret:
+    lock = cache_lock();
+    if(ret) lru_touch(hash_hex);
+    assert(0 == sem_post(sem));
+    assert(0 == sem_close(sem));
+    /* someone who was waiting on it may have already removed it */
+    res = sem_unlink(hash_hex);
+    assert(res == 0 || errno == ENOENT);
+    cache_counters_add(&counters);
+    cache_unlock(lock);
+free_ret:
+    free(fullpath);
+    if(fd_dst) *fd_dst = fd;
+    return ret;
+}
+
+char * mcp_fs_cache_file(const char * file_path)
+{
+    return cache_file(file_path, NULL);
+}
+
+char * mcp_fs_cache_name(const char * file_path)
+{
+    int peer_id;
+    const char * p;
+    char * fullpath = module_file_path(file_path, &peer_id, &p);
+    if(fullpath == NULL) return NULL;
+
+    /* only the hash, so the entry isn't filled or marked used */
+    uint8_t hash[32];
+    uint8_t prev_hash[32];
+    bool has_prev;
+    cache_counters_t counters;
+    memset(&counters, 0, sizeof(counters));
+    int res = cache_file_hash(peer_id, p, hash, prev_hash, &has_prev, &counters);
+    free(fullpath);
+    if(res) return NULL;
+
+    char * ret = malloc(CACHE_PATH_MAX);
+    assert(ret);
+    memcpy(ret, MNT_CACHE, sizeof(MNT_CACHE) - 1);
+    raw_to_hex(ret + (sizeof(MNT_CACHE) - 1), hash, 32);
+    ret[(sizeof(MNT_CACHE) - 1) + HASH_HEX_LEN] = '\0';
+    return ret;
+}
+
+int mcp_fs_cache_open(const char * file_path, char ** cachepath_dst)
+{
+    int fd;
+    char * cachepath = cache_file(file_path, &fd);
+    if(cachepath_dst) *cachepath_dst = cachepath;
+    else free(cachepath);
+    return fd;
+}
@@ -0,0 +1,230 @@
+#include <nuttx/config.h>
+
+#include <mcp/mcp_fs.h>
+#include <mcp/mcpd.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "mcp_fs_private.h"
+
+/* Block delta protocol (4). The module, which has the new version of
+   a file, only has to checksum it. The host rolls the checksums over the
+   version it has cached and asks for just the blocks it couldn't find.
+
+   host:   name_len u8, name, block_size u32
+   module: status u8 (0 ok, 1 ioerror, 3 noent, 4 nametoolong)
+           file_size u32, file_fnv u64,
+           then for every block: weak u32, strong u64
+   host:   missing_count u32, missing block indices u32 ascending
+   module: the missing blocks' data in order. The last block is short
+           if the file size is not a multiple of block_size.
+
+   weak is the rsync checksum: a = sum(x[i]), b = sum((len - i) * x[i]),
+   both mod 2^16, weak = a | b << 16. strong and file_fnv are 64 bit
+   FNV-1a. */
+
+#define DELTA_BLOCK_SIZE 256
+#define DELTA_MAX_FILE_SIZE 65536
+
+typedef struct {
+    uint32_t weak;
+    uint64_t strong;
+} block_sum_t;
+
+static uint64_t fnv1a64(const uint8_t * data, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static void weak_init(const uint8_t * data, size_t len, uint32_t * a_dst, uint32_t * b_dst)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for(size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (len - i) * data[i];
+    }
+    *a_dst = a & 0xffff;
+    *b_dst = b & 0xffff;
+}
+
+/* open addressing, slots hold block index + 1 */
+static uint16_t * table_build(const block_sum_t * sums, uint32_t block_count, uint32_t * mask_dst)
+{
+    uint32_t size = 16;
+    while(size < block_count * 2) size *= 2;
+    uint16_t * table = calloc(size, sizeof(uint16_t));
+    assert(table);
+    for(uint32_t i = 0; i < block_count; i++) {
+        uint32_t slot = sums[i].weak & (size - 1);
+        while(table[slot]) slot = (slot + 1) & (size - 1);
+        table[slot] = i + 1;
+    }
+    *mask_dst = size - 1;
+    return table;
+}
+
+static uint8_t * read_whole_file(const char * path, size_t * len_dst)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat st;
+    assert(0 == fstat(fd, &st));
+    uint8_t * buf = NULL;
+    if(st.st_size > 0 && st.st_size <= DELTA_MAX_FILE_SIZE) {
+        buf = malloc(st.st_size);
+        assert(buf);
+        if(st.st_size != read(fd, buf, st.st_size)) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    assert(0 == close(fd));
+
+    *len_dst = st.st_size;
+    return buf;
+}
+
+/* Reconstruct the module's current version of `file_name` using the
+   cached file at `old_path` as the source of matching blocks. Returns
+   a malloc'd buffer, or NULL if the caller should copy the whole file. */
+uint8_t * mcp_fs_delta_fetch(int peer_id, const char * file_name, const char * old_path,
+                             size_t * len_dst, size_t * transferred_dst)
+{
+    int res;
+
+    size_t file_name_len = strlen(file_name);
+    if(file_name_len > 255) return NULL;
+
+    size_t old_len;
+    uint8_t * old = read_whole_file(old_path, &old_len);
+    if(old == NULL) return NULL;
+
+    uint8_t * new = NULL;
+    block_sum_t * sums = NULL;
+    uint16_t * table = NULL;
+    uint8_t * have = NULL;
+    uint32_t * missing = NULL;
+
+    mcpd_con_t con;
+    res = mcp_fs_util_connect(&con, peer_id);
+    if(res) goto free_ret;
+
+    uint8_t byte = 4; /* block delta protocol */
+    mcpd_write(con, &byte, 1);
+    mcpd_read(con, &byte, 1);
+    if(byte) goto disconnect_ret;
+
+    byte = file_name_len;
+    mcpd_write(con, &byte, 1);
+    mcpd_write(con, file_name, file_name_len);
+    uint32_t block_size = DELTA_BLOCK_SIZE;
+    mcpd_write(con, &block_size, 4);
+
+    mcpd_read(con, &byte, 1);
+    if(byte) goto disconnect_ret;
+
+    uint32_t file_size;
+    uint64_t file_fnv;
+    mcpd_read(con, &file_size, 4);
+    mcpd_read(con, &file_fnv, 8);
+    /* disconnecting mid-reply is how we abandon it */
+    if(file_size == 0 || file_size > DELTA_MAX_FILE_SIZE) goto disconnect_ret;
+
+    uint32_t block_count = (file_size + block_size - 1) / block_size;
+    uint32_t tail_len = file_size - (block_count - 1) * block_size;
+    sums = malloc(block_count * sizeof(block_sum_t));
+    assert(sums);
+    for(uint32_t i = 0; i < block_count; i++) {
+        mcpd_read(con, &sums[i].weak, 4);
+        mcpd_read(con, &sums[i].strong, 8);
+    }
+
+    new = malloc(file_size);
+    assert(new);
+    have = calloc(block_count, 1);
+    assert(have);
+
+    /* full blocks can be found at any offset of the old version */
+    uint32_t mask;
+    table = table_build(sums, tail_len == block_size ? block_count : block_count - 1, &mask);
+    if(old_len >= block_size) {
+        uint32_t a, b;
+        weak_init(old, block_size, &a, &b);
+        for(size_t off = 0; ; off++) {
+            uint32_t weak = a | (b << 16);
+            for(uint32_t slot = weak & mask; table[slot]; slot = (slot + 1) & mask) {
+                uint32_t i = table[slot] - 1;
+                if(have[i] || sums[i].weak != weak) continue;
+                if(sums[i].strong != fnv1a64(old + off, block_size)) continue;
+                memcpy(new + i * block_size, old + off, block_size);
+                have[i] = 1;
+            }
+            if(off + block_size == old_len) break;
+            uint8_t out = old[off];
+            uint8_t in = old[off + block_size];
+            a = (a - out + in) & 0xffff;
+            b = (b - block_size * out + a) & 0xffff;
+        }
+    }
+
+    /* a short last block is only looked for at the end of the old version */
+    if(tail_len != block_size && old_len >= tail_len) {
+        uint32_t i = block_count - 1;
+        const uint8_t * cand = old + old_len - tail_len;
+        uint32_t a, b;
+        weak_init(cand, tail_len, &a, &b);
+        if(sums[i].weak == (a | (b << 16)) && sums[i].strong == fnv1a64(cand, tail_len)) {
+            memcpy(new + i * block_size, cand, tail_len);
+            have[i] = 1;
+        }
+    }
+
+    uint32_t missing_count = 0;
+    missing = malloc(block_count * sizeof(uint32_t));
+    assert(missing);
+    for(uint32_t i = 0; i < block_count; i++) {
+        if(!have[i]) missing[missing_count++] = i;
+    }
+
+    mcpd_write(con, &missing_count, 4);
+    mcpd_write(con, missing, missing_count * sizeof(uint32_t));
+    size_t transferred = 0;
+    for(uint32_t j = 0; j < missing_count; j++) {
+        uint32_t i = missing[j];
+        uint32_t len = i == block_count - 1 ? tail_len : block_size;
+        mcpd_read(con, new + i * block_size, len);
+        transferred += len;
+    }
+
+    if(file_fnv != fnv1a64(new, file_size)) {
+        free(new);
+        new = NULL;
+        goto disconnect_ret;
+    }
+
+    *len_dst = file_size;
+    *transferred_dst = transferred;
+
+disconnect_ret:
+    mcpd_disconnect(con);
+free_ret:
+    free(missing);
+    free(have);
+    free(table);
+    free(sums);
+    free(old);
+    return new;
+}
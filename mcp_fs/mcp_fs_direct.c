@@ -0,0 +1,117 @@
+#include <nuttx/config.h>
+
+#include <mcp/mcp_fs.h>
+#include <mcp/mcpd.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mcp_fs_private.h"
+
+/* Read a module file straight over mcpd, for filling the cache. Going
+   through /mnt/mcp would copy every byte through the userfs request
+   buffer on top of the mcpd socket, and split the transfer into
+   requests no bigger than that buffer. Here the whole file is one
+   CONTINUE and each chunk is read from the socket into a buffer and
+   written out from there. */
+
+#define DIRECT_BUF_SIZE 4096
+
+int mcp_fs_direct_open(int peer_id, const char * file_name, mcpd_con_t * con_dst,
+                       uint32_t * size_dst)
+{
+    int res;
+    mcpd_con_t con;
+
+    size_t file_name_len = strlen(file_name);
+    if(file_name_len > 255) return MCPD_NAMETOOLONG;
+
+    res = mcp_fs_util_connect(&con, peer_id);
+    if(res) return res;
+
+    uint8_t buf[1 + 2 + 4 + 2];
+
+    buf[0] = 0; // protocol
+    mcpd_write(con, buf, 1);
+    mcpd_read(con, buf, 1);
+    if(buf[0] != 0) {
+        mcpd_disconnect(con);
+        return MCPD_PROTOCOL_NOT_SUP;
+    }
+
+    buf[0] = FS_BASE_ACTION_READ;
+    buf[1] = file_name_len;
+    mcpd_write(con, buf, 2);
+    mcpd_write(con, file_name, file_name_len);
+    mcpd_read(con, buf, 1);
+    if(buf[0]) {
+        mcpd_disconnect(con);
+        return buf[0] == 3 ? MCPD_NOENT : MCPD_IOERROR;
+    }
+
+    buf[0] = FS_OPEN_FILE_ACTION_STAT;
+    mcpd_write(con, buf, 1);
+    mcpd_read(con, buf, sizeof(buf));
+    if(buf[0]) {
+        mcp_fs_direct_close(con);
+        return MCPD_IOERROR;
+    }
+
+    memcpy(size_dst, buf + 3, 4);
+    *con_dst = con;
+    return MCPD_OK;
+}
+
+bool mcp_fs_direct_read_to_fd(mcpd_con_t con, int dst_fd, uint32_t size)
+{
+    ssize_t rwres;
+
+    uint8_t * buf = malloc(DIRECT_BUF_SIZE);
+    assert(buf);
+
+    uint8_t req[5];
+    req[0] = FS_OPEN_FILE_ACTION_CONTINUE;
+    memcpy(req + 1, &size, 4);
+    mcpd_write(con, req, 5);
+
+    /* keep reading the module's reply even if writing fails so the
+       connection stays in step */
+    bool ok = true;
+    uint32_t remaining = size;
+    uint32_t chunk;
+    while(remaining) {
+        mcpd_read(con, &chunk, 4);
+        if(!chunk) break;
+        assert(chunk <= remaining);
+        remaining -= chunk;
+        while(chunk) {
+            uint32_t len = chunk < DIRECT_BUF_SIZE ? chunk : DIRECT_BUF_SIZE;
+            mcpd_read(con, buf, len);
+            if(ok) {
+                rwres = write(dst_fd, buf, len);
+                ok = rwres == len;
+            }
+            chunk -= len;
+        }
+    }
+
+    free(buf);
+
+    uint8_t result;
+    mcpd_read(con, &result, 1);
+
+    /* a file that shrank since the stat is a failed read too */
+    return ok && result == 0 && remaining == 0;
+}
+
+void mcp_fs_direct_close(mcpd_con_t con)
+{
+    uint8_t buf[1];
+
+    buf[0] = FS_OPEN_FILE_ACTION_CLOSE;
+    mcpd_write(con, buf, 1);
+    mcpd_read(con, buf, 1);
+    mcpd_disconnect(con);
+}
@@ -0,0 +1,204 @@
+#include <nuttx/config.h>
+
+#include <mcp/mcp_fs.h>
+#include <mcp/mcpd.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+
+#include "mcp_fs_private.h"
+
+#ifdef CONFIG_MCP_APPS_MCP_FS_PREFETCH
+
+#define PREFETCH_QUEUE_LEN 8
+#define PREFETCH_PATH_MAX 272 /* "/mnt/mcp/" + peer id + '/' + 255 byte name */
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t peers[PREFETCH_QUEUE_LEN];
+    int head;
+    int count;
+} queue = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER
+};
+
+/* The loader is told about the module right away. If it asks for a file
+   that is being prefetched, it waits on the entry's fill semaphore and
+   gets the copy being made instead of fetching it a second time. */
+void mcp_fs_prefetch_peer(int peer_id)
+{
+    mcp_fs_ready_announce(peer_id);
+
+    assert(0 == pthread_mutex_lock(&queue.mutex));
+    /* if the workers are this far behind, the loader will fetch it itself */
+    if(queue.count < PREFETCH_QUEUE_LEN) {
+        queue.peers[(queue.head + queue.count) % PREFETCH_QUEUE_LEN] = peer_id;
+        queue.count++;
+        assert(0 == pthread_cond_signal(&queue.cond));
+    }
+    assert(0 == pthread_mutex_unlock(&queue.mutex));
+}
+
+static int queue_pop(void)
+{
+    assert(0 == pthread_mutex_lock(&queue.mutex));
+    while(queue.count == 0) {
+        assert(0 == pthread_cond_wait(&queue.cond, &queue.mutex));
+    }
+    int peer_id = queue.peers[queue.head];
+    queue.head = (queue.head + 1) % PREFETCH_QUEUE_LEN;
+    queue.count--;
+    assert(0 == pthread_mutex_unlock(&queue.mutex));
+    return peer_id;
+}
+
+static void prefetch_file(int peer_id, const char * name)
+{
+    char path[PREFETCH_PATH_MAX];
+    int res = snprintf(path, sizeof(path), MNT_MCP "%d/%s", peer_id, name);
+    if(res < 0 || res >= sizeof(path)) return;
+
+    free(mcp_fs_cache_file(path));
+}
+
+#if CONFIG_MCP_APPS_MCP_FS_PREFETCH_MAX_SIZE
+static bool is_well_known(const char * name)
+{
+    const char * list = CONFIG_MCP_APPS_MCP_FS_PREFETCH_FILES;
+    size_t name_len = strlen(name);
+
+    while(*list) {
+        size_t len = strcspn(list, " ");
+        if(len == name_len && 0 == memcmp(list, name, len)) return true;
+        list += len;
+        list += strspn(list, " ");
+    }
+    return false;
+}
+
+static void prefetch_small_files(int peer_id)
+{
+    int res;
+    char path[PREFETCH_PATH_MAX];
+    struct stat st;
+
+    snprintf(path, sizeof(path), MNT_MCP "%d", peer_id);
+    DIR * dirp = opendir(path);
+    if(dirp == NULL) return;
+
+    /* stat while the dir is open, the sizes come with the listing */
+    char * names = NULL;
+    size_t names_len = 0;
+    struct dirent * de;
+    while((de = readdir(dirp))) {
+        if(is_well_known(de->d_name)) continue;
+        res = snprintf(path, sizeof(path), MNT_MCP "%d/%s", peer_id, de->d_name);
+        if(res < 0 || res >= sizeof(path)) continue;
+        if(0 != stat(path, &st)
+           || !S_ISREG(st.st_mode)
+           || st.st_size > CONFIG_MCP_APPS_MCP_FS_PREFETCH_MAX_SIZE) continue;
+        size_t len = strlen(de->d_name) + 1;
+        names = realloc(names, names_len + len);
+        assert(names);
+        memcpy(names + names_len, de->d_name, len);
+        names_len += len;
+    }
+    assert(0 == closedir(dirp));
+
+    for(size_t pos = 0; pos < names_len; pos += strlen(names + pos) + 1) {
+        prefetch_file(peer_id, names + pos);
+    }
+
+    free(names);
+}
+#endif
+
+static void prefetch_peer(int peer_id)
+{
+    const char * list = CONFIG_MCP_APPS_MCP_FS_PREFETCH_FILES;
+    char name[256];
+
+    while(*list) {
+        size_t len = strcspn(list, " ");
+        if(len > 0 && len < sizeof(name)) {
+            memcpy(name, list, len);
+            name[len] = '\0';
+            prefetch_file(peer_id, name);
+        }
+        list += len;
+        list += strspn(list, " ");
+    }
+
+#if CONFIG_MCP_APPS_MCP_FS_PREFETCH_MAX_SIZE
+    prefetch_small_files(peer_id);
+#endif
+}
+
+static void * worker_thread(void * arg)
+{
+    while(1) {
+        prefetch_peer(queue_pop());
+    }
+
+    return NULL;
+}
+
+static void start_thread(void * (*fn)(void *))
+{
+    int res;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    res = pthread_attr_init(&attr);
+    assert(res == 0);
+
+    res = pthread_attr_setstacksize(&attr, CONFIG_MCP_APPS_MCP_FS_PREFETCH_STACKSIZE);
+    assert(res == 0);
+
+    /* This only orders CPU time. Module reads share the link whatever
+       their priority. */
+    struct sched_param sched_param = {.sched_priority = CONFIG_MCP_APPS_MCP_FS_PREFETCH_PRIORITY};
+    res = pthread_attr_setschedparam(&attr, &sched_param);
+    assert(res == 0);
+
+    res = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    assert(res == 0);
+
+    res = pthread_create(&thread, &attr, fn, NULL);
+    assert(res == 0);
+
+    res = pthread_detach(thread);
+    assert(res == 0);
+
+    res = pthread_attr_destroy(&attr);
+    assert(res == 0);
+}
+
+void mcp_fs_prefetch_start(void)
+{
+    for(int i = 0; i < CONFIG_MCP_APPS_MCP_FS_PREFETCH_WORKERS; i++) {
+        start_thread(worker_thread);
+    }
+}
+
+#else
+
+void mcp_fs_prefetch_start(void)
+{
+}
+
+void mcp_fs_prefetch_peer(int peer_id)
+{
+    mcp_fs_ready_announce(peer_id);
+}
+
+#endif
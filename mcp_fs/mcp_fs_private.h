@@ -0,0 +1,32 @@
+#pragma once
+
+#include <mcp/mcp_fs.h>
+#include <mcp/mcpd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MNT_MCP_DIR "/mnt/mcp"
+#define MNT_MCP MNT_MCP_DIR "/"
+#define MNT_CACHE "/data/"
+
+#define FS_BASE_ACTION_WRITE      0
+#define FS_BASE_ACTION_READ       1
+#define FS_BASE_ACTION_LS         2
+#define FS_BASE_ACTION_DELETE     3
+
+#define FS_OPEN_FILE_ACTION_CONTINUE   0
+#define FS_OPEN_FILE_ACTION_CLOSE      1
+#define FS_OPEN_FILE_ACTION_STAT       2
+
+int mcp_fs_util_decode_path(const char ** srcdst);
+int mcp_fs_util_connect(mcpd_con_t * con_dst, int peer_id);
+void mcp_fs_ready_announce(int peer_id);
+void mcp_fs_prefetch_start(void);
+void mcp_fs_prefetch_peer(int peer_id);
+int mcp_fs_direct_open(int peer_id, const char * file_name, mcpd_con_t * con_dst,
+                       uint32_t * size_dst);
+bool mcp_fs_direct_read_to_fd(mcpd_con_t con, int dst_fd, uint32_t size);
+void mcp_fs_direct_close(mcpd_con_t con);
+uint8_t * mcp_fs_delta_fetch(int peer_id, const char * file_name, const char * old_path,
+                             size_t * len_dst, size_t * transferred_dst);
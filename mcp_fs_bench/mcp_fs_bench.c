@@ -0,0 +1,367 @@
+#include <nuttx/config.h>
+
+#include <mcp/mcp_fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/mount.h>
+
+#include "mcp_fs_bench_private.h"
+
+#define DEFAULT_STANDIN_DIR "/tmp/mcp_fs_bench"
+#define DEFAULT_PEER_COUNT 2
+#define MAX_PEERS 16
+#define FILE_SIZE (64 * 1024)
+#define BENCH_FILE "bench.bin"
+#define CACHE_FILE "bench_cache.bin"
+#define LATENCY_ITERATIONS 20
+#define WARM_ITERATIONS 5
+#define MOUNT_WAIT_US 10000
+#define MOUNT_WAIT_COUNT 500
+
+static const int buffer_sizes[] = {64, 512, 4096, 16384};
+
+typedef struct {
+    FILE * files[2];
+    int file_count;
+} report_t;
+
+typedef struct {
+    int peer_id;
+    uint64_t bytes;
+} peer_job_t;
+
+static void show_usage(void)
+{
+    fprintf(stderr, "usage: mcp_fs_bench [-r] [-d standin_dir] [-n peer_count] [-o report_path]\n");
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    assert(0 == clock_gettime(CLOCK_MONOTONIC, &ts));
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t rate(uint64_t bytes, uint64_t us)
+{
+    return us ? bytes * 1000000 / us : 0;
+}
+
+/* one "key value" line per measurement, same as `mcp_fs -s` */
+static void report(report_t * r, const char * key, uint64_t value)
+{
+    for(int i = 0; i < r->file_count; i++) {
+        fprintf(r->files[i], "%s %llu\n", key, (unsigned long long) value);
+    }
+}
+
+static void peer_path(char * dst, size_t dst_len, int peer_id, const char * name)
+{
+    int res = snprintf(dst, dst_len, "/mnt/mcp/%d/%s", peer_id, name);
+    assert(res > 0 && res < dst_len);
+}
+
+static bool write_file(const char * path, int bs, uint32_t seed)
+{
+    ssize_t rwres;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if(fd < 0) return false;
+
+    uint8_t * buf = malloc(bs);
+    assert(buf);
+    bool ok = true;
+    for(uint32_t pos = 0; ok && pos < FILE_SIZE; pos += bs) {
+        size_t len = FILE_SIZE - pos < bs ? FILE_SIZE - pos : bs;
+        for(size_t i = 0; i < len; i++) buf[i] = (pos + i) * 31 + seed;
+        rwres = write(fd, buf, len);
+        ok = rwres == len;
+    }
+    free(buf);
+
+    return 0 == close(fd) && ok;
+}
+
+static uint64_t read_file(const char * path, int bs)
+{
+    ssize_t rwres;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return 0;
+
+    uint8_t * buf = malloc(bs);
+    assert(buf);
+    uint64_t total = 0;
+    while((rwres = read(fd, buf, bs)) > 0) total += rwres;
+    free(buf);
+
+    assert(0 == close(fd));
+    return total;
+}
+
+static void bench_sequential(report_t * r, int peer_id)
+{
+    char path[64];
+    char key[32];
+    peer_path(path, sizeof(path), peer_id, BENCH_FILE);
+
+    for(int i = 0; i < sizeof(buffer_sizes) / sizeof(*buffer_sizes); i++) {
+        int bs = buffer_sizes[i];
+
+        uint64_t t = now_us();
+        bool ok = write_file(path, bs, 0);
+        t = now_us() - t;
+        snprintf(key, sizeof(key), "write_bps_bs%d", bs);
+        report(r, key, ok ? rate(FILE_SIZE, t) : 0);
+
+        t = now_us();
+        uint64_t bytes = read_file(path, bs);
+        t = now_us() - t;
+        snprintf(key, sizeof(key), "read_bps_bs%d", bs);
+        report(r, key, rate(bytes, t));
+    }
+}
+
+static void bench_metadata(report_t * r, int peer_id)
+{
+    char path[64];
+    struct stat st;
+    uint64_t t;
+
+    peer_path(path, sizeof(path), peer_id, BENCH_FILE);
+    t = now_us();
+    for(int i = 0; i < LATENCY_ITERATIONS; i++) stat(path, &st);
+    report(r, "stat_us", (now_us() - t) / LATENCY_ITERATIONS);
+
+    peer_path(path, sizeof(path), peer_id, "");
+    t = now_us();
+    for(int i = 0; i < LATENCY_ITERATIONS; i++) {
+        DIR * dirp = opendir(path);
+        if(dirp == NULL) continue;
+        while(readdir(dirp));
+        assert(0 == closedir(dirp));
+    }
+    report(r, "opendir_us", (now_us() - t) / LATENCY_ITERATIONS);
+
+    /* what `ls -l` does */
+    char entry_path[64 + NAME_MAX];
+    t = now_us();
+    for(int i = 0; i < LATENCY_ITERATIONS; i++) {
+        DIR * dirp = opendir(path);
+        if(dirp == NULL) continue;
+        struct dirent * de;
+        while((de = readdir(dirp))) {
+            snprintf(entry_path, sizeof(entry_path), "%s%s", path, de->d_name);
+            stat(entry_path, &st);
+        }
+        assert(0 == closedir(dirp));
+    }
+    report(r, "opendir_stat_us", (now_us() - t) / LATENCY_ITERATIONS);
+
+    t = now_us();
+    for(int i = 0; i < LATENCY_ITERATIONS; i++) {
+        DIR * dirp = opendir("/mnt/mcp");
+        if(dirp == NULL) continue;
+        while(readdir(dirp));
+        assert(0 == closedir(dirp));
+    }
+    report(r, "root_opendir_us", (now_us() - t) / LATENCY_ITERATIONS);
+}
+
+static void bench_cache(report_t * r, int peer_id)
+{
+    char path[64];
+    uint64_t t;
+
+    /* new content each run so the first lookup is a real miss */
+    peer_path(path, sizeof(path), peer_id, CACHE_FILE);
+    if(!write_file(path, 4096, now_us())) {
+        report(r, "cache_cold_us", 0);
+        report(r, "cache_warm_us", 0);
+        return;
+    }
+
+    t = now_us();
+    free(mcp_fs_cache_file(path));
+    report(r, "cache_cold_us", now_us() - t);
+
+    t = now_us();
+    for(int i = 0; i < WARM_ITERATIONS; i++) free(mcp_fs_cache_file(path));
+    report(r, "cache_warm_us", (now_us() - t) / WARM_ITERATIONS);
+}
+
+static void * peer_read_thread(void * arg)
+{
+    peer_job_t * job = arg;
+    char path[64];
+
+    peer_path(path, sizeof(path), job->peer_id, BENCH_FILE);
+    job->bytes = read_file(path, 4096);
+    return NULL;
+}
+
+static void bench_multi_peer(report_t * r, const int * peers, int peer_count)
+{
+    char path[64];
+    peer_job_t jobs[MAX_PEERS];
+    pthread_t threads[MAX_PEERS];
+
+    for(int i = 0; i < peer_count; i++) {
+        peer_path(path, sizeof(path), peers[i], BENCH_FILE);
+        write_file(path, 4096, i);
+        jobs[i].peer_id = peers[i];
+        jobs[i].bytes = 0;
+    }
+
+    uint64_t t = now_us();
+    for(int i = 0; i < peer_count; i++) {
+        assert(0 == pthread_create(&threads[i], NULL, peer_read_thread, &jobs[i]));
+    }
+    uint64_t total = 0;
+    for(int i = 0; i < peer_count; i++) {
+        assert(0 == pthread_join(threads[i], NULL));
+        total += jobs[i].bytes;
+    }
+    t = now_us() - t;
+
+    report(r, "multi_peer_count", peer_count);
+    report(r, "multi_peer_read_bps", rate(total, t));
+}
+
+static bool wait_for_mount(int peer_id)
+{
+    char path[64];
+    peer_path(path, sizeof(path), peer_id, "");
+    for(int i = 0; i < MOUNT_WAIT_COUNT; i++) {
+        if(0 == access(path, F_OK)) return true;
+        usleep(MOUNT_WAIT_US);
+    }
+    return false;
+}
+
+static int find_real_peers(int * peers, int max)
+{
+    int count = 0;
+    DIR * dirp = opendir("/mnt/mcp");
+    if(dirp == NULL) return 0;
+    struct dirent * de;
+    while(count < max && (de = readdir(dirp))) {
+        char * end;
+        long id = strtol(de->d_name, &end, 10);
+        if(*end != '\0' || end == de->d_name) continue;
+        peers[count++] = id;
+    }
+    assert(0 == closedir(dirp));
+    return count;
+}
+
+static int bench_peers(const char * report_path, bool use_real, const int * peers,
+                       int peer_count)
+{
+    if(peer_count == 0) {
+        fprintf(stderr, "no modules under /mnt/mcp\n");
+        return 1;
+    }
+
+    report_t r;
+    r.files[0] = stdout;
+    r.file_count = 1;
+    if(report_path) {
+        r.files[1] = fopen(report_path, "w");
+        if(r.files[1] == NULL) {
+            perror("fopen");
+            return 1;
+        }
+        r.file_count = 2;
+    }
+
+    report(&r, "standin", !use_real);
+    report(&r, "file_size", FILE_SIZE);
+    bench_sequential(&r, peers[0]);
+    bench_metadata(&r, peers[0]);
+    bench_cache(&r, peers[0]);
+    bench_multi_peer(&r, peers, peer_count);
+
+    if(report_path) assert(0 == fclose(r.files[1]));
+
+    return 0;
+}
+
+/* The mounts are taken down while mcp_fs is still there to serve
+   them, then mcp_fs and the stand-ins go. */
+static void standin_teardown(pid_t pid, const int * peers, int peer_count)
+{
+    char path[64];
+
+    for(int i = 0; i < peer_count; i++) {
+        snprintf(path, sizeof(path), "/mnt/mcp/%d", peers[i]);
+        if(0 != umount(path)) perror(path);
+    }
+    if(pid > 0 && 0 != kill(pid, SIGKILL)) perror("kill mcp_fs");
+    mcp_fs_bench_standin_stop();
+}
+
+int mcp_fs_bench_main(int argc, char *argv[])
+{
+    int res;
+    bool use_real = false;
+    const char * standin_dir = DEFAULT_STANDIN_DIR;
+    int peer_count = DEFAULT_PEER_COUNT;
+    const char * report_path = NULL;
+
+    int opt;
+    while((opt = getopt(argc, argv, "rd:n:o:")) >= 0) {
+        if(opt == 'r') use_real = true;
+        else if(opt == 'd') standin_dir = optarg;
+        else if(opt == 'n') peer_count = atoi(optarg);
+        else if(opt == 'o') report_path = optarg;
+        else {
+            show_usage();
+            return 1;
+        }
+    }
+    if(peer_count < 1 || peer_count > MAX_PEERS) {
+        show_usage();
+        return 1;
+    }
+
+    int peers[MAX_PEERS];
+
+    if(use_real) {
+        peer_count = find_real_peers(peers, peer_count);
+        return bench_peers(report_path, use_real, peers, peer_count);
+    }
+
+    if(0 != mcp_fs_bench_standin_start(standin_dir, peer_count)) return 1;
+
+    pid_t pid;
+    res = posix_spawn(&pid, "mcp_fs", NULL, NULL, NULL, NULL);
+    if(res != 0) {
+        fprintf(stderr, "mcp_fs_bench: spawn mcp_fs: %s\n", strerror(res));
+        mcp_fs_bench_standin_stop();
+        return 1;
+    }
+
+    int mounted = 0;
+    for(int i = 0; i < peer_count; i++) {
+        if(wait_for_mount(i)) peers[mounted++] = i;
+    }
+
+    int ret = bench_peers(report_path, use_real, peers, mounted);
+    standin_teardown(pid, peers, mounted);
+    return ret;
+}
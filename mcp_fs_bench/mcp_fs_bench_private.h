@@ -0,0 +1,4 @@
+#pragma once
+
+int mcp_fs_bench_standin_start(const char * dir, int peer_count);
+void mcp_fs_bench_standin_stop(void);
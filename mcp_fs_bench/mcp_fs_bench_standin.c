@@ -0,0 +1,641 @@
+#include <nuttx/config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "mcpd_private.h"
+#include "mcp_fs_bench_private.h"
+
+/* Stand-in modules. This takes mcpd's place on its socket and serves
+   peers 0 to peer_count - 1 as if they were modules whose filesystems
+   are the directories <dir>/<peer id>. Every connection gets a thread
+   that plays the module side of the module protocols. */
+
+#define STANDIN_PATH_MAX 300
+#define STANDIN_CHUNK 1024
+
+typedef struct {
+    int sock;
+    int peer_id;
+    int file_fd;
+} module_t;
+
+static struct {
+    const char * dir;
+    int peer_count;
+    pthread_mutex_t mutex;
+    bool * busy;
+} standin = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER
+};
+
+static void start_thread(void * (*fn)(void *), void * arg, pthread_t * thread_dst)
+{
+    int res;
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    res = pthread_attr_init(&attr);
+    assert(res == 0);
+
+    res = pthread_attr_setstacksize(&attr, CONFIG_MCP_APPS_MCP_FS_BENCH_STANDIN_STACKSIZE);
+    assert(res == 0);
+
+    res = pthread_create(&thread, &attr, fn, arg);
+    assert(res == 0);
+
+    if(thread_dst) *thread_dst = thread;
+    else assert(0 == pthread_detach(thread));
+
+    res = pthread_attr_destroy(&attr);
+    assert(res == 0);
+}
+
+static bool copy_bytes(int dst, int src, uint32_t len)
+{
+    ssize_t rwres;
+    uint8_t buf[STANDIN_CHUNK];
+
+    while(len) {
+        uint32_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+        rwres = mcpd_util_full_read(src, buf, chunk);
+        if(rwres != chunk) return false;
+        rwres = send(dst, buf, chunk, MSG_NOSIGNAL);
+        if(rwres != chunk) return false;
+        len -= chunk;
+    }
+    return true;
+}
+
+/* module side helpers. The host going away ends the module thread. */
+
+static void mod_exit(module_t * m)
+{
+    if(m->file_fd >= 0) assert(0 == close(m->file_fd));
+    assert(0 == close(m->sock));
+    free(m);
+    pthread_exit(NULL);
+}
+
+static void mod_read(module_t * m, void * buf, size_t len)
+{
+    if(len == 0) return;
+    if(len != mcpd_util_full_read(m->sock, buf, len)) mod_exit(m);
+}
+
+static void mod_write(module_t * m, const void * buf, size_t len)
+{
+    if(len == 0) return;
+    if(len != send(m->sock, buf, len, MSG_NOSIGNAL)) mod_exit(m);
+}
+
+static void mod_write_byte(module_t * m, uint8_t byte)
+{
+    mod_write(m, &byte, 1);
+}
+
+/* returns 0 or the protocol's status for a bad name */
+static uint8_t mod_read_path(module_t * m, char * path_dst)
+{
+    uint8_t name_len;
+    char name[256];
+
+    mod_read(m, &name_len, 1);
+    mod_read(m, name, name_len);
+    name[name_len] = '\0';
+
+    if(name_len == 0 || NULL != memchr(name, '/', name_len)) return 3;
+    snprintf(path_dst, STANDIN_PATH_MAX, "%s/%d/%s", standin.dir, m->peer_id, name);
+    return 0;
+}
+
+static uint8_t errno_status(void)
+{
+    switch(errno) {
+        case ENOENT: return 3;
+        case EACCES: return 2;
+        case ENAMETOOLONG: return 4;
+        case ENOSPC: return 5;
+        case EROFS: return 6;
+    }
+    return 1;
+}
+
+static void fs_open_file(module_t * m, bool reading)
+{
+    ssize_t rwres;
+    char path[STANDIN_PATH_MAX];
+
+    uint8_t status = mod_read_path(m, path);
+    if(!status) {
+        m->file_fd = open(path, reading ? O_RDONLY : O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(m->file_fd < 0) status = errno_status();
+    }
+    mod_write_byte(m, status);
+    if(status) return;
+
+    while(1) {
+        uint8_t action;
+        mod_read(m, &action, 1);
+
+        if(action == 0) { /* continue */
+            uint32_t len;
+            mod_read(m, &len, 4);
+            if(reading) {
+                uint8_t buf[STANDIN_CHUNK];
+                while(len) {
+                    uint32_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+                    rwres = read(m->file_fd, buf, chunk);
+                    assert(rwres >= 0);
+                    chunk = rwres;
+                    mod_write(m, &chunk, 4);
+                    if(chunk == 0) break;
+                    mod_write(m, buf, chunk);
+                    len -= chunk;
+                }
+                mod_write_byte(m, 0);
+            } else {
+                while(len) {
+                    uint8_t buf[STANDIN_CHUNK];
+                    uint32_t chunk = len < sizeof(buf) ? len : sizeof(buf);
+                    mod_read(m, buf, chunk);
+                    rwres = write(m->file_fd, buf, chunk);
+                    if(rwres != chunk) status = 5;
+                    len -= chunk;
+                }
+                mod_write_byte(m, status);
+            }
+        }
+        else if(action == 1) { /* close */
+            status = close(m->file_fd) ? 1 : 0;
+            m->file_fd = -1;
+            mod_write_byte(m, status);
+            return;
+        }
+        else { /* stat */
+            assert(action == 2);
+            struct stat st;
+            assert(0 == fstat(m->file_fd, &st));
+            uint8_t buf[1 + 2 + 4 + 2];
+            buf[0] = 0;
+            uint16_t mode = st.st_mode & 0777;
+            memcpy(buf + 1, &mode, 2);
+            uint32_t size = st.st_size;
+            memcpy(buf + 3, &size, 4);
+            uint16_t blksize = 512;
+            memcpy(buf + 7, &blksize, 2);
+            mod_write(m, buf, sizeof(buf));
+        }
+    }
+}
+
+/* the LS action's listing, or protocol 5's which has stat fields too */
+static void write_listing(module_t * m, bool with_stat)
+{
+    char path[STANDIN_PATH_MAX];
+    struct stat st;
+
+    char * names = NULL;
+    uint32_t names_len = 0;
+    snprintf(path, sizeof(path), "%s/%d", standin.dir, m->peer_id);
+    DIR * dirp = opendir(path);
+    if(dirp) {
+        struct dirent * de;
+        while((de = readdir(dirp))) {
+            if(de->d_type != DT_REG) continue;
+            size_t len = strlen(de->d_name) + 1;
+            size_t header_len = with_stat ? 2 + 4 + 2 : 0;
+            names = realloc(names, names_len + header_len + len);
+            assert(names);
+            if(with_stat) {
+                snprintf(path, sizeof(path), "%s/%d/%s", standin.dir, m->peer_id, de->d_name);
+                if(stat(path, &st)) memset(&st, 0, sizeof(st));
+                uint16_t mode = st.st_mode & 0777;
+                uint32_t size = st.st_size;
+                uint16_t blksize = 512;
+                memcpy(names + names_len, &mode, 2);
+                memcpy(names + names_len + 2, &size, 4);
+                memcpy(names + names_len + 6, &blksize, 2);
+            }
+            memcpy(names + names_len + header_len, de->d_name, len);
+            names_len += header_len + len;
+        }
+        assert(0 == closedir(dirp));
+    }
+    mod_write(m, &names_len, 4);
+    mod_write(m, names, names_len);
+    free(names);
+}
+
+static void protocol_fs(module_t * m)
+{
+    uint8_t action;
+    char path[STANDIN_PATH_MAX];
+
+    mod_read(m, &action, 1);
+
+    if(action == 0 || action == 1) { /* write, read */
+        fs_open_file(m, action == 1);
+    }
+    else if(action == 2) { /* ls */
+        write_listing(m, false);
+    }
+    else if(action == 3) { /* delete */
+        uint8_t status = mod_read_path(m, path);
+        if(!status && unlink(path)) status = errno_status();
+        mod_write_byte(m, status);
+    }
+}
+
+/* compact sha256 for the hash protocol */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t * h, const uint8_t * p)
+{
+    uint32_t w[64];
+    for(int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) p[i * 4] << 24 | p[i * 4 + 1] << 16 | p[i * 4 + 2] << 8 | p[i * 4 + 3];
+    }
+    for(int i = 16; i < 64; i++) {
+        uint32_t s0 = ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+    for(int i = 0; i < 64; i++) {
+        uint32_t t1 = hh + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g))
+                      + sha256_k[i] + w[i];
+        uint32_t t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        hh = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+}
+
+static bool sha256_fd(int fd, uint8_t * hash_dst)
+{
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    uint8_t block[64];
+    uint64_t total = 0;
+    size_t fill = 0;
+    ssize_t rwres;
+
+    while((rwres = read(fd, block + fill, sizeof(block) - fill)) > 0) {
+        fill += rwres;
+        total += rwres;
+        if(fill == sizeof(block)) {
+            sha256_block(h, block);
+            fill = 0;
+        }
+    }
+    if(rwres < 0) return false;
+
+    block[fill++] = 0x80;
+    if(fill > 56) {
+        memset(block + fill, 0, 64 - fill);
+        sha256_block(h, block);
+        fill = 0;
+    }
+    memset(block + fill, 0, 56 - fill);
+    uint64_t bits = total * 8;
+    for(int i = 0; i < 8; i++) block[63 - i] = bits >> (i * 8);
+    sha256_block(h, block);
+
+    for(int i = 0; i < 32; i++) hash_dst[i] = h[i / 4] >> (24 - (i % 4) * 8);
+    return true;
+}
+
+static void protocol_hash(module_t * m)
+{
+    char path[STANDIN_PATH_MAX];
+    uint8_t hash[32];
+
+    uint8_t status = mod_read_path(m, path);
+    if(!status) {
+        m->file_fd = open(path, O_RDONLY);
+        if(m->file_fd < 0) status = errno_status();
+        else if(!sha256_fd(m->file_fd, hash)) status = 1;
+    }
+    mod_write_byte(m, status);
+    if(status) return;
+    mod_write(m, hash, 32);
+}
+
+static void protocol_generation(module_t * m)
+{
+    char path[STANDIN_PATH_MAX];
+    struct stat st;
+
+    uint8_t status = mod_read_path(m, path);
+    if(!status && stat(path, &st)) status = errno_status();
+    mod_write_byte(m, status);
+    if(status) return;
+
+    uint8_t uid[8] = {'s', 't', 'a', 'n', 'd', 'i', 'n', m->peer_id};
+    uint32_t generation = st.st_mtime * 2654435761u ^ st.st_size ^ st.st_ino << 16;
+    mod_write(m, uid, 8);
+    mod_write(m, &generation, 4);
+}
+
+static uint64_t fnv1a64(const uint8_t * data, size_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i < len; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint32_t weak_sum(const uint8_t * data, size_t len)
+{
+    uint32_t a = 0;
+    uint32_t b = 0;
+    for(size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (len - i) * data[i];
+    }
+    return (a & 0xffff) | (b & 0xffff) << 16;
+}
+
+static void protocol_block_delta(module_t * m)
+{
+    char path[STANDIN_PATH_MAX];
+    struct stat st;
+    uint32_t block_size;
+
+    uint8_t status = mod_read_path(m, path);
+    mod_read(m, &block_size, 4);
+    if(block_size == 0) status = 1;
+    if(!status) {
+        m->file_fd = open(path, O_RDONLY);
+        if(m->file_fd < 0) status = errno_status();
+    }
+    mod_write_byte(m, status);
+    if(status) return;
+
+    assert(0 == fstat(m->file_fd, &st));
+    uint32_t file_size = st.st_size;
+    uint8_t * data = malloc(file_size ? file_size : 1);
+    assert(data);
+    assert(file_size == mcpd_util_full_read(m->file_fd, data, file_size));
+
+    uint64_t file_fnv = fnv1a64(data, file_size);
+    mod_write(m, &file_size, 4);
+    mod_write(m, &file_fnv, 8);
+    uint32_t block_count = (file_size + block_size - 1) / block_size;
+    for(uint32_t i = 0; i < block_count; i++) {
+        uint32_t len = i == block_count - 1 ? file_size - i * block_size : block_size;
+        uint32_t weak = weak_sum(data + i * block_size, len);
+        uint64_t strong = fnv1a64(data + i * block_size, len);
+        mod_write(m, &weak, 4);
+        mod_write(m, &strong, 8);
+    }
+
+    uint32_t missing_count;
+    mod_read(m, &missing_count, 4);
+    for(uint32_t j = 0; j < missing_count; j++) {
+        uint32_t i;
+        mod_read(m, &i, 4);
+        if(i >= block_count) break;
+        uint32_t len = i == block_count - 1 ? file_size - i * block_size : block_size;
+        mod_write(m, data + i * block_size, len);
+    }
+
+    free(data);
+}
+
+static void * module_thread(void * arg)
+{
+    module_t * m = arg;
+
+    uint8_t protocol;
+    mod_read(m, &protocol, 1);
+
+    switch(protocol) {
+        case 0:
+            mod_write_byte(m, 0);
+            protocol_fs(m);
+            break;
+        case 2:
+            mod_write_byte(m, 0);
+            protocol_hash(m);
+            break;
+        case 3:
+            mod_write_byte(m, 0);
+            protocol_generation(m);
+            break;
+        case 4:
+            mod_write_byte(m, 0);
+            protocol_block_delta(m);
+            break;
+        case 5:
+            mod_write_byte(m, 0);
+            write_listing(m, true);
+            break;
+        default:
+            mod_write_byte(m, 1); /* not supported */
+            break;
+    }
+
+    /* wait for the host to disconnect */
+    uint8_t byte;
+    mod_read(m, &byte, 1);
+    mod_exit(m);
+    return NULL;
+}
+
+static void serve_watcher(int fd)
+{
+    ssize_t rwres;
+
+    for(int i = 0; i < standin.peer_count; i++) {
+        uint8_t token = i;
+        rwres = send(fd, &token, 1, MSG_NOSIGNAL);
+        if(rwres != 1) return;
+    }
+
+    /* the stand-ins never come or go after this */
+    uint8_t byte;
+    while(0 < read(fd, &byte, 1));
+}
+
+/* returns true if the host quit cleanly */
+static bool serve_peer(int fd, int peer_id)
+{
+    int res;
+    ssize_t rwres;
+
+    int pair[2];
+    res = socketpair(AF_UNIX, SOCK_STREAM, 0, pair);
+    assert(res == 0);
+
+    module_t * m = malloc(sizeof(module_t));
+    assert(m);
+    m->sock = pair[1];
+    m->peer_id = peer_id;
+    m->file_fd = -1;
+    pthread_t module;
+    start_thread(module_thread, m, &module);
+
+    bool quit = false;
+    while(1) {
+        uint8_t operation;
+        rwres = read(fd, &operation, 1);
+        if(rwres != 1) break;
+
+        if(operation == OPERATION_QUIT) {
+            quit = true;
+            break;
+        }
+
+        uint32_t len;
+        rwres = mcpd_util_full_read(fd, &len, 4);
+        if(rwres != 4) break;
+
+        bool ok;
+        if(operation == OPERATION_WRITE) ok = copy_bytes(pair[0], fd, len);
+        else if(operation == OPERATION_READ) ok = copy_bytes(fd, pair[0], len);
+        else ok = false; /* no pins or resources on a stand-in */
+        if(!ok) break;
+    }
+
+    assert(0 == close(pair[0]));
+    assert(0 == pthread_join(module, NULL));
+    return quit;
+}
+
+static void * connection_thread(void * arg)
+{
+    ssize_t rwres;
+
+    int fd = (intptr_t) arg;
+
+    uint8_t token;
+    rwres = read(fd, &token, 1);
+    if(rwres != 1) goto close_ret;
+
+    if(token == 255) {
+        serve_watcher(fd);
+        goto close_ret;
+    }
+
+    uint8_t response = RESULT_OK;
+    assert(0 == pthread_mutex_lock(&standin.mutex));
+    if(token >= standin.peer_count) response = RESULT_TOKEN_DOESNT_EXIST;
+    else if(standin.busy[token]) response = RESULT_MODULE_BUSY;
+    else standin.busy[token] = true;
+    assert(0 == pthread_mutex_unlock(&standin.mutex));
+
+    send(fd, &response, 1, MSG_NOSIGNAL);
+
+    if(response == RESULT_OK) {
+        bool quit = serve_peer(fd, token);
+
+        /* free before the quit is acknowledged, like mcpd, so the host
+           can connect again right away */
+        assert(0 == pthread_mutex_lock(&standin.mutex));
+        standin.busy[token] = false;
+        assert(0 == pthread_mutex_unlock(&standin.mutex));
+
+        if(quit) send(fd, &response, 1, MSG_NOSIGNAL);
+    }
+
+close_ret:
+    assert(0 == close(fd));
+    return NULL;
+}
+
+static void * accept_thread(void * arg)
+{
+    int srv = (intptr_t) arg;
+
+    while(1) {
+        int fd = accept(srv, NULL, NULL);
+        assert(fd >= 0);
+        start_thread(connection_thread, (void *)(intptr_t) fd, NULL);
+    }
+
+    return NULL;
+}
+
+/* returns 0, or -1 if the socket is taken, by mcpd or a stand-in
+   that didn't stop */
+int mcp_fs_bench_standin_start(const char * dir, int peer_count)
+{
+    int res;
+    char path[STANDIN_PATH_MAX];
+
+    standin.dir = dir;
+    standin.peer_count = peer_count;
+    standin.busy = calloc(peer_count, sizeof(bool));
+    assert(standin.busy);
+
+    res = mkdir(dir, 0777);
+    assert(res == 0 || errno == EEXIST);
+    for(int i = 0; i < peer_count; i++) {
+        snprintf(path, sizeof(path), "%s/%d", dir, i);
+        res = mkdir(path, 0777);
+        assert(res == 0 || errno == EEXIST);
+    }
+
+    int srv = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(srv >= 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    assert(sizeof(SOC_PATH) <= sizeof(addr.sun_path));
+    memcpy(addr.sun_path, SOC_PATH, sizeof(SOC_PATH));
+    res = bind(srv, (struct sockaddr *)&addr, sizeof(addr));
+    if(res != 0) {
+        fprintf(stderr, "mcp_fs_bench: bind " SOC_PATH ": %s, is mcpd running?\n",
+                strerror(errno));
+        assert(0 == close(srv));
+        free(standin.busy);
+        return -1;
+    }
+    res = listen(srv, 255);
+    assert(res == 0);
+
+    /* same as mcpd. This lets clients waiting for the daemon through. */
+    res = mkfifo(SOC_WAITER_FIFO, 0666);
+    assert(res >= 0 || errno == EEXIST);
+    int srv_fifo = open(SOC_WAITER_FIFO, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    assert(srv_fifo >= 0);
+
+    start_thread(accept_thread, (void *)(intptr_t) srv, NULL);
+    return 0;
+}
+
+/* The threads and sockets go with the task. The socket's name has to
+   be removed so the next run, or mcpd, can bind it. */
+void mcp_fs_bench_standin_stop(void)
+{
+    int res = unlink(SOC_PATH);
+    assert(res == 0);
+}
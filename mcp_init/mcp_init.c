@@ -1,3 +1,5 @@
+#include <nuttx/config.h>
+
 #include <unistd.h>
 #include <sys/types.h>
 #include <stdio.h>
@@ -7,16 +9,31 @@
 
 #include <mcp/mcpd.h>
 
+#ifdef CONFIG_MCP_APPS_MCP_FS
+    #include <mcp/mcp_fs_ready.h>
+#endif
+
+#ifdef CONFIG_MCP_APPS_MCP_INIT_FORTH_DAEMON
+    #include <mcp/mcp_forth_queue.h>
+#endif
+
 static void run_forth(int peer_id)
 {
-    int res;
     char path[32];
+
+    snprintf(path, sizeof(path), "/mnt/mcp/%d/main.4th", peer_id);
+
+#ifdef CONFIG_MCP_APPS_MCP_INIT_FORTH_DAEMON
+    mcp_forth_queue_t mq = mcp_forth_queue_open();
+    mcp_forth_queue_send(mq, peer_id, path);
+    mcp_forth_queue_close(mq);
+#else
+    int res;
     char peer[16];
     pid_t pid;
 
     char prog_name[] = "mcp_forth";
     char opt_fl[] = "-O";
-    snprintf(path, sizeof(path), "/mnt/mcp/%d/main.4th", peer_id);
     char * task_argv[] = {prog_name, opt_fl, path, NULL};
 
     snprintf(peer, sizeof(peer), "%d", peer_id);
@@ -25,6 +42,7 @@ static void run_forth(int peer_id)
 
     res = posix_spawn(&pid, "mcp_forth", NULL, NULL, task_argv, NULL);
     assert(res >= 0);
+#endif
 }
 
 int mcp_init_main(int argc, char *argv[])
@@ -38,12 +56,31 @@ int mcp_init_main(int argc, char *argv[])
     res = posix_spawn(&pid, "mcp_fs", NULL, NULL, NULL, NULL);
     assert(res >= 0);
 
+#ifdef CONFIG_MCP_APPS_MCP_INIT_FORTH_DAEMON
+    char forth_prog_name[] = "mcp_forth";
+    char forth_opt_O[] = "-O";
+    char forth_opt_d[] = "-d";
+    char * forth_task_argv[] = {forth_prog_name, forth_opt_O, forth_opt_d, NULL};
+    res = posix_spawn(&pid, "mcp_forth", NULL, NULL, forth_task_argv, NULL);
+    assert(res >= 0);
+#endif
+
     char prog_name[] = "mcp_lvgl";
     char opt_fl[] = "-O";
     char * task_argv[] = {prog_name, opt_fl, NULL};
     res = posix_spawn(&pid, "mcp_lvgl", NULL, NULL, task_argv, NULL);
     assert(res >= 0);
 
+#ifdef CONFIG_MCP_APPS_MCP_FS
+    /* mcp_fs says when a module's files can be read */
+    mcp_fs_ready_t ready = mcp_fs_ready_open();
+
+    while(1) {
+        run_forth(mcp_fs_ready_wait(ready));
+    }
+
+    /* mcp_fs_ready_close(ready); */
+#else
     mcpd_watch_t watch = mcpd_watch_create();
 
     while(1) {
@@ -54,6 +91,7 @@ int mcp_init_main(int argc, char *argv[])
     }
 
     /* mcpd_watch_destroy(watch); */
+#endif
 
     return 0;
 }
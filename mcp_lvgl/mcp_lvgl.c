@@ -11,6 +11,8 @@
 #include <nuttx/input/touchscreen.h>
 #include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
 
 #include <mcp/mcp_lvgl.h>
 #include <mcp/mcp_lvgl_common_private.h>
@@ -32,7 +34,6 @@
 #include <lvgl/src/core/lv_global.h>
 
 #define MQ_MSGSIZE 64
-#define FORTH_DRIVER_MEMORY_SIZE 2048
 
 #define APP_BENCHMARK 1
 
@@ -45,21 +46,37 @@ typedef void (*app_cb_t)(lv_obj_t * base_obj);
 typedef struct {
     const char * name;
     app_cb_t cb;
+    struct forth_driver_s * drv; /* that registered it, if known */
 } app_entry_t;
 
 typedef struct {
     int app_count;
     app_entry_t * app_entries;
     lv_obj_t * app_list_obj;
+    struct forth_driver_s * open_app_drv; /* the driver of the app on screen */
     bool forth_native;
 #ifdef CONFIG_MCP_APPS_MCP_LVGL_STATIC_FB_STATIC
     bool static_fb_is_held;
 #endif
 } lvgl_user_data_t;
 
-typedef struct {
+typedef void (*mcp_lvgl_driver_unload_cb_t)(void * user_data);
+
+typedef struct forth_driver_s {
     mcp_forth_load_t load;
-    uint8_t memory[FORTH_DRIVER_MEMORY_SIZE];
+    mcp_lvgl_driver_unload_cb_t unload_cb;
+    void * unload_user_data;
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    char * path;
+    char * hash_path; /* what the source was last seen as, reload thread only */
+    bool reload_pending;
+    bool reload_failed;
+    /* LVGL thread only */
+    int outstanding; /* async mcpd operations, work and coroutines */
+    bool retiring; /* unloaded once nothing is outstanding */
+    bool swap_queued;
+    struct reload_s * reload; /* run once the old version is unloaded */
+#endif
 } forth_driver_t;
 
 typedef struct driver_ll_s {
@@ -83,9 +100,53 @@ typedef struct {
     mcpd_con_t con;
     mcp_lvgl_async_cb_t cb;
     void * user_data;
+    forth_driver_t * drv;
     uint32_t cur_events;
 } mcp_lvgl_async_t;
 
+#if CONFIG_MCP_APPS_MCP_LVGL_WORKERS
+typedef int (*mcp_lvgl_work_cb_t)(void * user_data);
+typedef void (*mcp_lvgl_work_done_cb_t)(void * user_data, int result);
+
+typedef struct work_s {
+    struct work_s * next;
+    mcp_lvgl_work_cb_t work_cb;
+    mcp_lvgl_work_done_cb_t done_cb;
+    void * user_data;
+    forth_driver_t * drv;
+    int result;
+} work_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    work_t * head; /* queued, guarded by lock */
+    work_t * tail;
+    bool stop;
+    int outstanding; /* submitted and not yet done, LVGL thread only */
+    int pipe_fds[2];
+    mcp_lvgl_poll_t * poll;
+    int thread_count;
+    pthread_t threads[CONFIG_MCP_APPS_MCP_LVGL_WORKERS];
+} work_pool_t;
+#endif
+
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_COROUTINES
+typedef void (*mcp_lvgl_co_cb_t)(void * user_data);
+
+typedef struct {
+    pthread_t thread;
+    sem_t run;
+    sem_t back; /* for when it resumes another coroutine */
+    sem_t * resumer; /* the back of whoever resumed it last */
+    mcp_lvgl_co_cb_t cb;
+    void * user_data;
+    forth_driver_t * drv;
+    uint32_t revents;
+    bool done;
+} co_t;
+#endif
+
 #ifdef CONFIG_MCP_APPS_MCP_LVGL_STATIC_FB_STATIC
 static uint8_t static_fb[CONFIG_MCP_APPS_MCP_LVGL_STATIC_FB_SIZE] __attribute__((aligned(4)));
 #endif
@@ -94,6 +155,43 @@ static uint8_t static_fb[CONFIG_MCP_APPS_MCP_LVGL_STATIC_FB_SIZE] __attribute__(
 static uint8_t static_thread_stack[CONFIG_MCP_APPS_MCP_LVGL_STATIC_STACK_THREAD_STACKSIZE] __attribute__((aligned(16)));
 #endif
 
+/* the driver whose code the LVGL thread is running, if it's known */
+static forth_driver_t * running_driver;
+
+static pthread_t lvgl_thread;
+#if CONFIG_MCP_APPS_MCP_LVGL_WORKERS || defined(CONFIG_MCP_APPS_MCP_LVGL_COROUTINES)
+static bool on_lvgl_thread(void);
+#endif
+
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+static int unowned_outstanding; /* started where the driver wasn't known */
+static void driver_retire_try(forth_driver_t * drv);
+static void driver_retire_try_all(void);
+#endif
+
+/* Async mcpd operations, work and coroutines are counted against the
+   driver that started them until they finish so that its code isn't
+   freed under them. */
+static void driver_hold(forth_driver_t * drv)
+{
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    if(drv) drv->outstanding++;
+    else unowned_outstanding++;
+#endif
+}
+
+static void driver_release(forth_driver_t * drv)
+{
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    if(drv) {
+        if(--drv->outstanding == 0) driver_retire_try(drv);
+    }
+    else if(--unowned_outstanding == 0) {
+        driver_retire_try_all();
+    }
+#endif
+}
+
 static const m4_runtime_cb_array_t runtime_lib_lvgl_common[] = {
     {"mcp_lvgl_poll_add", {m4_f14, mcp_lvgl_poll_add}},
     {"mcp_lvgl_poll_modify", {m4_f02, mcp_lvgl_poll_modify}},
@@ -184,6 +282,8 @@ static void create_app_list(void)
 
 static void app_obj_delete_cb(lv_event_t * e)
 {
+    lvgl_user_data_t * ud = LV_GLOBAL_DEFAULT()->user_data;
+    ud->open_app_drv = NULL;
     create_app_list();
 }
 
@@ -199,7 +299,15 @@ static void app_clicked_cb(lv_event_t * e)
     lv_obj_set_style_bg_opa(base_obj, LV_OPA_COVER, 0);
     lv_obj_add_event_cb(base_obj, app_obj_delete_cb, LV_EVENT_DELETE, NULL);
     app_cb_t app_cb = lv_event_get_user_data(e);
+    forth_driver_t * drv = NULL;
+    for(int i = 0; i < ud->app_count; i++) {
+        if(ud->app_entries[i].cb == app_cb) drv = ud->app_entries[i].drv;
+    }
+    ud->open_app_drv = drv;
+    forth_driver_t * prev = running_driver;
+    running_driver = drv;
     app_cb(base_obj);
+    running_driver = prev;
 }
 
 static void add_entry_to_app_list_obj(lv_obj_t * list, const app_entry_t * entry)
@@ -217,6 +325,7 @@ static int mcp_lvgl_app_register(void * param, m4_stack_t * stack)
     assert(ud->app_entries);
     ud->app_entries[ud->app_count - 1].name = (const char *) stack->data[-2];
     ud->app_entries[ud->app_count - 1].cb   = (app_cb_t)     stack->data[-1];
+    ud->app_entries[ud->app_count - 1].drv  = running_driver;
     if(ud->app_list_obj) {
         add_entry_to_app_list_obj(ud->app_list_obj, &ud->app_entries[ud->app_count - 1]);
     }
@@ -239,7 +348,11 @@ static void async_poll_cb(mcp_lvgl_poll_t * handle, int fd, uint32_t revents, vo
 
     if(res == MCPD_OK) {
         mcp_lvgl_poll_remove(handle);
+        forth_driver_t * prev = running_driver;
+        running_driver = a->drv;
         a->cb(a->user_data);
+        running_driver = prev;
+        driver_release(a->drv);
         lv_free(a);
         return;
     }
@@ -272,7 +385,9 @@ static void mcp_lvgl_async_mcpd_inner(int mcpd_need, mcpd_con_t con,
     a->con = con;
     a->cb = cb;
     a->user_data = user_data;
+    a->drv = running_driver;
     a->cur_events = events;
+    driver_hold(a->drv);
     mcp_lvgl_poll_add(fd, async_poll_cb, events, a);
 }
 
@@ -329,11 +444,432 @@ static const m4_runtime_cb_array_t runtime_lib_static_fb[] = {
     {NULL}
 };
 
-static void load_forth_driver(forth_driver_t * drv, const char * path)
+#if CONFIG_MCP_APPS_MCP_LVGL_WORKERS
+/* Drivers hand blocking work to a small pool of threads so it doesn't
+   hold up the LVGL thread. The work callback runs on a worker and its
+   result comes back to the done callback on the LVGL thread through a
+   pipe that mcp_lvgl_poll watches while any work is outstanding. At
+   most MCP_APPS_MCP_LVGL_WORK_QUEUE_LEN pieces of work are outstanding
+   so a worker never blocks on the pipe. Workers don't touch LVGL, not
+   even its allocator. */
+
+static work_pool_t work_pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void * work_thread(void * arg)
+{
+    ssize_t rwres;
+
+    while(1) {
+        assert(0 == pthread_mutex_lock(&work_pool.lock));
+        while(!work_pool.head && !work_pool.stop) {
+            assert(0 == pthread_cond_wait(&work_pool.cond, &work_pool.lock));
+        }
+        if(work_pool.stop) {
+            assert(0 == pthread_mutex_unlock(&work_pool.lock));
+            break;
+        }
+        work_t * w = work_pool.head;
+        work_pool.head = w->next;
+        if(!work_pool.head) work_pool.tail = NULL;
+        assert(0 == pthread_mutex_unlock(&work_pool.lock));
+
+        w->result = w->work_cb(w->user_data);
+
+        rwres = write(work_pool.pipe_fds[1], &w, sizeof(w));
+        assert(rwres == sizeof(w));
+    }
+
+    return NULL;
+}
+
+static void work_pool_start(void)
 {
     int res;
+    pthread_attr_t attr;
 
-    lvgl_user_data_t * ud = LV_GLOBAL_DEFAULT()->user_data;
+    res = pipe(work_pool.pipe_fds);
+    assert(res == 0);
+    int flags = fcntl(work_pool.pipe_fds[0], F_GETFL, 0);
+    assert(flags != -1);
+    assert(-1 != fcntl(work_pool.pipe_fds[0], F_SETFL, flags | O_NONBLOCK));
+
+    res = pthread_attr_init(&attr);
+    assert(res == 0);
+    res = pthread_attr_setstacksize(&attr, CONFIG_MCP_APPS_MCP_LVGL_WORKER_STACKSIZE);
+    assert(res == 0);
+    for(int i = 0; i < CONFIG_MCP_APPS_MCP_LVGL_WORKERS; i++) {
+        res = pthread_create(&work_pool.threads[i], &attr, work_thread, NULL);
+        assert(res == 0);
+    }
+    res = pthread_attr_destroy(&attr);
+    assert(res == 0);
+
+    work_pool.thread_count = CONFIG_MCP_APPS_MCP_LVGL_WORKERS;
+}
+
+/* nothing is outstanding once the poll loop has returned */
+static void work_pool_stop(void)
+{
+    int res;
+
+    if(!work_pool.thread_count) return;
+    assert(work_pool.outstanding == 0);
+
+    assert(0 == pthread_mutex_lock(&work_pool.lock));
+    work_pool.stop = true;
+    assert(0 == pthread_cond_broadcast(&work_pool.cond));
+    assert(0 == pthread_mutex_unlock(&work_pool.lock));
+
+    for(int i = 0; i < work_pool.thread_count; i++) {
+        res = pthread_join(work_pool.threads[i], NULL);
+        assert(res == 0);
+    }
+    work_pool.thread_count = 0;
+
+    assert(0 == close(work_pool.pipe_fds[0]));
+    assert(0 == close(work_pool.pipe_fds[1]));
+}
+
+static void work_poll_cb(mcp_lvgl_poll_t * handle, int fd, uint32_t revents, void * user_data)
+{
+    assert(revents == EPOLLIN);
+
+    ssize_t rwres;
+
+    work_t * w;
+    while(sizeof(w) == (rwres = read(fd, &w, sizeof(w)))) {
+        work_pool.outstanding--;
+        /* it may submit more work */
+        if(w->done_cb) {
+            forth_driver_t * prev = running_driver;
+            running_driver = w->drv;
+            w->done_cb(w->user_data, w->result);
+            running_driver = prev;
+        }
+        driver_release(w->drv);
+        lv_free(w);
+    }
+    assert(rwres < 0 && errno == EAGAIN);
+
+    if(work_pool.outstanding == 0) {
+        mcp_lvgl_poll_remove(handle);
+        work_pool.poll = NULL;
+    }
+}
+
+/* returns 0, or -1 if too much work is outstanding or it isn't called
+   from the LVGL thread or a coroutine */
+static int mcp_lvgl_work_submit(mcp_lvgl_work_cb_t work_cb, mcp_lvgl_work_done_cb_t done_cb,
+                                void * user_data)
+{
+    /* the pool's bookkeeping is the LVGL thread's */
+    if(!on_lvgl_thread()) return -1;
+    if(work_pool.outstanding == CONFIG_MCP_APPS_MCP_LVGL_WORK_QUEUE_LEN) return -1;
+
+    if(!work_pool.thread_count) work_pool_start();
+
+    work_t * w = lv_malloc(sizeof(*w));
+    assert(w);
+    w->next = NULL;
+    w->work_cb = work_cb;
+    w->done_cb = done_cb;
+    w->user_data = user_data;
+    w->drv = running_driver;
+    driver_hold(w->drv);
+
+    if(!work_pool.poll) {
+        work_pool.poll = mcp_lvgl_poll_add(work_pool.pipe_fds[0], work_poll_cb, EPOLLIN, NULL);
+    }
+    work_pool.outstanding++;
+
+    assert(0 == pthread_mutex_lock(&work_pool.lock));
+    if(work_pool.tail) work_pool.tail->next = w;
+    else work_pool.head = w;
+    work_pool.tail = w;
+    assert(0 == pthread_cond_signal(&work_pool.cond));
+    assert(0 == pthread_mutex_unlock(&work_pool.lock));
+
+    return 0;
+}
+
+static const m4_runtime_cb_array_t runtime_lib_lvgl_work[] = {
+    {"mcp_lvgl_work_submit", {m4_f13, mcp_lvgl_work_submit}},
+    {NULL}
+};
+#endif
+
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_COROUTINES
+/* Coroutines let a driver be written as straight-line code that awaits
+   mcpd and fd I/O without blocking the event loop. The engine can't
+   suspend a program midway, so each coroutine is a thread and a baton
+   is passed so that only one of the LVGL thread and the coroutines runs
+   at a time. A coroutine runs until it awaits, then the LVGL thread
+   carries on until mcp_lvgl_poll or an LVGL timer finds the awaited
+   thing ready and hands the baton back. Since it holds the baton a
+   coroutine may use LVGL like any other driver code. Awaiting outside
+   a coroutine just blocks. */
+
+static pthread_key_t co_key;
+static sem_t co_main_back; /* for the LVGL thread */
+static bool co_is_init;
+
+static void co_sem_wait(sem_t * sem)
+{
+    while(0 != sem_wait(sem)) {
+        assert(errno == EINTR);
+    }
+}
+
+static co_t * co_current(void)
+{
+    return co_is_init ? pthread_getspecific(co_key) : NULL;
+}
+
+/* Runs it until it awaits or returns. A coroutine may resume another,
+   by spawning it, so each resumer waits to get the baton back on a
+   semaphore of its own. */
+static void co_resume(co_t * co)
+{
+    int res;
+
+    co_t * self = co_current();
+    co->resumer = self ? &self->back : &co_main_back;
+    forth_driver_t * prev = running_driver;
+    running_driver = co->drv;
+    assert(0 == sem_post(&co->run));
+    co_sem_wait(co->resumer);
+    running_driver = prev;
+
+    if(co->done) {
+        res = pthread_join(co->thread, NULL);
+        assert(res == 0);
+        assert(0 == sem_destroy(&co->run));
+        assert(0 == sem_destroy(&co->back));
+        forth_driver_t * drv = co->drv;
+        lv_free(co);
+        driver_release(drv);
+    }
+}
+
+static void co_yield(co_t * co)
+{
+    assert(0 == sem_post(co->resumer));
+    co_sem_wait(&co->run);
+}
+
+static void * co_thread(void * arg)
+{
+    co_t * co = arg;
+
+    assert(0 == pthread_setspecific(co_key, co));
+    co_sem_wait(&co->run);
+
+    co->cb(co->user_data);
+
+    co->done = true;
+    assert(0 == sem_post(co->resumer));
+    return NULL;
+}
+
+/* returns 0 or -1 if the thread couldn't be made or it isn't called
+   from the LVGL thread or a coroutine */
+static int mcp_lvgl_co_spawn(mcp_lvgl_co_cb_t cb, void * user_data)
+{
+    int res;
+    pthread_attr_t attr;
+
+    /* only one of the LVGL thread and the coroutines may run */
+    if(!on_lvgl_thread()) return -1;
+
+    if(!co_is_init) {
+        co_is_init = true;
+        assert(0 == pthread_key_create(&co_key, NULL));
+        assert(0 == sem_init(&co_main_back, 0, 0));
+    }
+
+    co_t * co = lv_malloc(sizeof(*co));
+    assert(co);
+    co->cb = cb;
+    co->user_data = user_data;
+    co->drv = running_driver;
+    co->done = false;
+    assert(0 == sem_init(&co->run, 0, 0));
+    assert(0 == sem_init(&co->back, 0, 0));
+
+    res = pthread_attr_init(&attr);
+    assert(res == 0);
+    res = pthread_attr_setstacksize(&attr, CONFIG_MCP_APPS_MCP_LVGL_COROUTINE_STACKSIZE);
+    assert(res == 0);
+    res = pthread_create(&co->thread, &attr, co_thread, co);
+    assert(0 == pthread_attr_destroy(&attr));
+    if(res != 0) {
+        assert(0 == sem_destroy(&co->run));
+        assert(0 == sem_destroy(&co->back));
+        lv_free(co);
+        return -1;
+    }
+
+    driver_hold(co->drv);
+    co_resume(co);
+    return 0;
+}
+
+static void co_poll_cb(mcp_lvgl_poll_t * handle, int fd, uint32_t revents, void * user_data)
+{
+    co_t * co = user_data;
+    mcp_lvgl_poll_remove(handle);
+    co->revents = revents;
+    co_resume(co);
+}
+
+/* returns the events that happened */
+static uint32_t mcp_lvgl_co_await_fd(int fd, uint32_t events)
+{
+    co_t * co = co_current();
+    if(co == NULL) {
+        /* the epoll event bits are the poll ones */
+        struct pollfd pfd = {.fd = fd, .events = events};
+        while(poll(&pfd, 1, -1) < 0) {
+            assert(errno == EINTR);
+        }
+        return pfd.revents;
+    }
+
+    mcp_lvgl_poll_add(fd, co_poll_cb, events, co);
+    co_yield(co);
+    return co->revents;
+}
+
+static void co_timer_cb(lv_timer_t * timer)
+{
+    co_t * co = lv_timer_get_user_data(timer);
+    lv_timer_delete(timer);
+    co_resume(co);
+}
+
+static void mcp_lvgl_co_sleep(uint32_t ms)
+{
+    co_t * co = co_current();
+    if(co == NULL) {
+        usleep(ms * 1000);
+        return;
+    }
+
+    lv_timer_t * timer = lv_timer_create(co_timer_cb, ms, co);
+    assert(timer);
+    co_yield(co);
+}
+
+static void co_mcpd_finish(mcpd_con_t con, int mcpd_need)
+{
+    while(mcpd_need != MCPD_OK) {
+        uint32_t events;
+        if(mcpd_need == MCPD_ASYNC_WANT_WRITE) {
+            events = EPOLLOUT;
+        } else if(mcpd_need == MCPD_ASYNC_WANT_READ) {
+            events = EPOLLIN;
+        } else assert(0);
+        mcp_lvgl_co_await_fd(mcpd_get_async_polling_fd(con), events);
+        mcpd_need = mcpd_async_continue(con);
+    }
+}
+
+static void mcp_lvgl_co_mcpd_write(mcpd_con_t con, const void * src, uint32_t len)
+{
+    if(co_current() == NULL) {
+        mcpd_write(con, src, len);
+        return;
+    }
+    co_mcpd_finish(con, mcpd_async_write_start(con, src, len));
+}
+
+static void mcp_lvgl_co_mcpd_read(mcpd_con_t con, void * dst, uint32_t len)
+{
+    if(co_current() == NULL) {
+        mcpd_read(con, dst, len);
+        return;
+    }
+    co_mcpd_finish(con, mcpd_async_read_start(con, dst, len));
+}
+
+static const m4_runtime_cb_array_t runtime_lib_lvgl_co[] = {
+    {"mcp_lvgl_co_spawn", {m4_f12, mcp_lvgl_co_spawn}},
+    {"mcp_lvgl_co_await_fd", {m4_f12, mcp_lvgl_co_await_fd}},
+    {"mcp_lvgl_co_sleep", {m4_f01, mcp_lvgl_co_sleep}},
+    {"mcp_lvgl_co_mcpd_write", {m4_f03, mcp_lvgl_co_mcpd_write}},
+    {"mcp_lvgl_co_mcpd_read", {m4_f03, mcp_lvgl_co_mcpd_read}},
+    {NULL}
+};
+#endif
+
+#if CONFIG_MCP_APPS_MCP_LVGL_WORKERS || defined(CONFIG_MCP_APPS_MCP_LVGL_COROUTINES)
+/* a coroutine holds the baton when it runs, so it counts */
+static bool on_lvgl_thread(void)
+{
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_COROUTINES
+    if(co_current()) return true;
+#endif
+    return pthread_equal(pthread_self(), lvgl_thread);
+}
+#endif
+
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+static pthread_mutex_t hot_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* A driver that registers an unload callback can be taken down again,
+   which is what hot reload needs. The callback must undo what the
+   driver set up that calls back into it: its display, input devices,
+   polls and timers. It must also tell its coroutines to return and
+   stop starting async mcpd operations and work. The apps the driver
+   registered are taken off the list, and its program is only freed
+   once everything it started has finished. */
+static void mcp_lvgl_driver_on_unload(mcp_lvgl_driver_unload_cb_t cb, void * user_data)
+{
+    forth_driver_t * drv = running_driver;
+    if(drv == NULL) return;
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    assert(0 == pthread_mutex_lock(&hot_reload_lock));
+#endif
+    drv->unload_cb = cb;
+    drv->unload_user_data = user_data;
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    assert(0 == pthread_mutex_unlock(&hot_reload_lock));
+#endif
+}
+
+static const m4_runtime_cb_array_t runtime_lib_lvgl_driver[] = {
+    {"mcp_lvgl_driver_on_unload", {m4_f02, mcp_lvgl_driver_on_unload}},
+    {NULL}
+};
+
+static const m4_runtime_cb_array_t * const driver_cbs[] = {
+    m4_runtime_lib_io,
+    m4_runtime_lib_string,
+    m4_runtime_lib_time,
+    m4_runtime_lib_assert,
+    m4_runtime_lib_threadutil,
+    M4_RUNTIME_LIB_MCP_ALL_ENTRIES
+    runtime_lib_lvgl_app,
+    runtime_lib_lvgl_common,
+    runtime_lib_lvgl_async_mcpd,
+    runtime_lib_static_fb,
+#if CONFIG_MCP_APPS_MCP_LVGL_WORKERS
+    runtime_lib_lvgl_work,
+#endif
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_COROUTINES
+    runtime_lib_lvgl_co,
+#endif
+    runtime_lib_lvgl_driver,
+    NULL
+};
+
+static void set_driver_peer(const char * path)
+{
+    int res;
 
     int id = mcp_fs_path_get_peer_id(path);
     if(id >= 0) {
@@ -343,32 +879,37 @@ static void load_forth_driver(forth_driver_t * drv, const char * path)
         res = setenv("MCP_PEER", id_str, 1);
         assert(res == 0);
     }
+}
 
-    static const m4_runtime_cb_array_t * const cbs[] = {
-        m4_runtime_lib_io,
-        m4_runtime_lib_string,
-        m4_runtime_lib_time,
-        m4_runtime_lib_assert,
-        m4_runtime_lib_threadutil,
-        M4_RUNTIME_LIB_MCP_ALL_ENTRIES
-        runtime_lib_lvgl_app,
-        runtime_lib_lvgl_common,
-        runtime_lib_lvgl_async_mcpd,
-        runtime_lib_static_fb,
-        NULL
-    };
+static mcp_forth_error_t run_forth_driver(forth_driver_t * drv, const char * path,
+                                          mcp_forth_error_info_t * load_error)
+{
+    set_driver_peer(path);
+    running_driver = drv;
+    mcp_forth_error_t load_res = mcp_forth_run(&drv->load, load_error);
+    running_driver = NULL;
+    return load_res;
+}
+
+static void load_forth_driver(forth_driver_t * drv, const char * path)
+{
+    lvgl_user_data_t * ud = LV_GLOBAL_DEFAULT()->user_data;
 
     mcp_forth_error_info_t load_error;
-    mcp_forth_error_t load_res = mcp_forth_load_and_run_path(
+    mcp_forth_error_t load_res = mcp_forth_load_path(
         &drv->load,
         path,
-        drv->memory,
-        FORTH_DRIVER_MEMORY_SIZE,
-        cbs,
+        NULL,
+        0,
+        driver_cbs,
         ud->forth_native,
         &load_error
     );
 
+    if(load_res == MCP_FORTH_ERROR_NONE) {
+        load_res = run_forth_driver(drv, path, &load_error);
+    }
+
     mcp_forth_log_error(load_res, &load_error);
 
     if(load_res != MCP_FORTH_ERROR_NONE) {
@@ -428,11 +969,268 @@ static void add_driver(driver_ll_t ** drv_head_p, const char * path)
 {
     driver_ll_t * new_head = lv_malloc(sizeof(*new_head));
     assert(new_head);
+    memset(&new_head->drv, 0, sizeof(new_head->drv));
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    new_head->drv.path = strdup(path);
+    assert(new_head->drv.path);
+#endif
     new_head->next = *drv_head_p;
     load_forth_driver(&new_head->drv, path);
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    assert(0 == pthread_mutex_lock(&hot_reload_lock));
+#endif
     *drv_head_p = new_head;
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    assert(0 == pthread_mutex_unlock(&hot_reload_lock));
+#endif
 }
 
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+/* A thread looks at the sources of the loaded drivers that can be
+   unloaded every MCP_APPS_MCP_LVGL_HOT_RELOAD_INTERVAL_MS. mcp_fs names
+   its cache files after their content and only rehashes a file if the
+   module says its generation changed, so a changed cache file name is
+   a changed source and checking costs one round trip per driver. The
+   new version is compiled on that thread and handed to the LVGL thread
+   through a pipe. There, between events, the old version's unload
+   callback is called and its apps are taken off the list. The old
+   program is freed and the new one run in its place once the async
+   mcpd operations, work and coroutines it started have finished, and
+   any started where the driver wasn't known. The swap is done from an
+   LVGL async call so that it never happens with driver code on the
+   stack. A version that fails to load is reported and the driver stays
+   empty until the next change to its source. */
+
+typedef struct reload_s {
+    forth_driver_t * drv;
+    mcp_forth_load_t load;
+} reload_t;
+
+typedef struct {
+    driver_ll_t ** drv_head_p; /* guarded by hot_reload_lock */
+    bool native;
+    volatile bool stop;
+    int pipe_fds[2];
+    pthread_t thread;
+} hot_reload_t;
+
+static hot_reload_t hot_reload;
+
+static void * hot_reload_thread(void * arg)
+{
+    ssize_t rwres;
+
+    while(!hot_reload.stop) {
+        usleep(CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD_INTERVAL_MS * 1000);
+
+        /* drivers are only ever added to the front and freed after this
+           thread is stopped, so the rest of the list can be walked as is */
+        assert(0 == pthread_mutex_lock(&hot_reload_lock));
+        driver_ll_t * node = *hot_reload.drv_head_p;
+        assert(0 == pthread_mutex_unlock(&hot_reload_lock));
+
+        for(; node && !hot_reload.stop; node = node->next) {
+            forth_driver_t * drv = &node->drv;
+
+            assert(0 == pthread_mutex_lock(&hot_reload_lock));
+            bool reloadable = (drv->unload_cb || drv->reload_failed) && !drv->reload_pending;
+            assert(0 == pthread_mutex_unlock(&hot_reload_lock));
+            if(!reloadable) continue;
+
+            /* only a new version is loaded, which is what fills it */
+            char * hash_path = mcp_fs_cache_name(drv->path);
+            if(hash_path == NULL) continue;
+            if(drv->hash_path == NULL || 0 == strcmp(hash_path, drv->hash_path)) {
+                /* the first look only notes what it is */
+                if(drv->hash_path == NULL) drv->hash_path = hash_path;
+                else free(hash_path);
+                continue;
+            }
+            free(drv->hash_path);
+            drv->hash_path = hash_path;
+
+            reload_t * r = malloc(sizeof(*r));
+            assert(r);
+            r->drv = drv;
+            mcp_forth_error_info_t load_error;
+            mcp_forth_error_t load_res = mcp_forth_load_path(&r->load, drv->path, NULL, 0,
+                                                             driver_cbs, hot_reload.native,
+                                                             &load_error);
+            if(load_res != MCP_FORTH_ERROR_NONE) {
+                fprintf(stderr, "%s: ", drv->path);
+                mcp_forth_log_error(load_res, &load_error);
+                mcp_forth_unload(&r->load);
+                free(r);
+                continue;
+            }
+
+            assert(0 == pthread_mutex_lock(&hot_reload_lock));
+            drv->reload_pending = true;
+            assert(0 == pthread_mutex_unlock(&hot_reload_lock));
+            rwres = write(hot_reload.pipe_fds[1], &r, sizeof(r));
+            assert(rwres == sizeof(r));
+        }
+    }
+
+    return NULL;
+}
+
+static void app_entries_remove(forth_driver_t * drv)
+{
+    lvgl_user_data_t * ud = LV_GLOBAL_DEFAULT()->user_data;
+
+    int kept = 0;
+    for(int i = 0; i < ud->app_count; i++) {
+        if(ud->app_entries[i].drv != drv) ud->app_entries[kept++] = ud->app_entries[i];
+    }
+    bool removed = kept != ud->app_count;
+    ud->app_count = kept;
+
+    if(ud->open_app_drv == drv) {
+        /* closing the app brings the list back */
+        lv_obj_clean(lv_screen_active());
+    }
+    else if(removed && ud->app_list_obj) {
+        lv_obj_delete(ud->app_list_obj);
+        create_app_list();
+    }
+}
+
+static void driver_retire(forth_driver_t * drv)
+{
+    if(drv->unload_cb) {
+        forth_driver_t * prev = running_driver;
+        running_driver = drv;
+        drv->unload_cb(drv->unload_user_data);
+        running_driver = prev;
+    }
+    assert(0 == pthread_mutex_lock(&hot_reload_lock));
+    drv->unload_cb = NULL;
+    drv->unload_user_data = NULL;
+    assert(0 == pthread_mutex_unlock(&hot_reload_lock));
+
+    app_entries_remove(drv);
+
+    drv->retiring = true;
+    driver_retire_try(drv);
+}
+
+static void driver_swap_cb(void * user_data)
+{
+    forth_driver_t * drv = user_data;
+    drv->swap_queued = false;
+    /* more was started since, its release tries again */
+    if(drv->outstanding || unowned_outstanding) return;
+
+    drv->retiring = false;
+    mcp_forth_unload(&drv->load);
+    memset(&drv->load, 0, sizeof(drv->load));
+
+    reload_t * r = drv->reload;
+    drv->reload = NULL;
+    bool failed = true;
+    if(r) {
+        drv->load = r->load;
+        free(r);
+
+        mcp_forth_error_info_t load_error;
+        mcp_forth_error_t load_res = run_forth_driver(drv, drv->path, &load_error);
+        if(load_res != MCP_FORTH_ERROR_NONE) {
+            fprintf(stderr, "%s: ", drv->path);
+            mcp_forth_log_error(load_res, &load_error);
+            /* what it started before failing has to finish too */
+            driver_retire(drv);
+            return;
+        }
+        printf("%s: reloaded\n", drv->path);
+        failed = false;
+    }
+
+    assert(0 == pthread_mutex_lock(&hot_reload_lock));
+    drv->reload_failed = failed;
+    drv->reload_pending = false;
+    assert(0 == pthread_mutex_unlock(&hot_reload_lock));
+}
+
+static void driver_retire_try(forth_driver_t * drv)
+{
+    if(!drv->retiring || drv->swap_queued || drv->outstanding || unowned_outstanding) return;
+    drv->swap_queued = true;
+    lv_result_t res = lv_async_call(driver_swap_cb, drv);
+    assert(res == LV_RESULT_OK);
+}
+
+static void driver_retire_try_all(void)
+{
+    /* nothing retires before hot reload is started */
+    if(hot_reload.drv_head_p == NULL) return;
+    for(driver_ll_t * node = *hot_reload.drv_head_p; node; node = node->next) {
+        driver_retire_try(&node->drv);
+    }
+}
+
+static void hot_reload_poll_cb(mcp_lvgl_poll_t * handle, int fd, uint32_t revents, void * user_data)
+{
+    assert(revents == EPOLLIN);
+
+    ssize_t rwres;
+
+    reload_t * r;
+    while(sizeof(r) == (rwres = read(fd, &r, sizeof(r)))) {
+        /* reload_pending keeps another one from coming while it retires */
+        assert(r->drv->reload == NULL);
+        r->drv->reload = r;
+        driver_retire(r->drv);
+    }
+    assert(rwres < 0 && errno == EAGAIN);
+}
+
+static void hot_reload_start(driver_ll_t ** drv_head_p, bool native)
+{
+    int res;
+    pthread_attr_t attr;
+
+    hot_reload.drv_head_p = drv_head_p;
+    hot_reload.native = native;
+
+    res = pipe(hot_reload.pipe_fds);
+    assert(res == 0);
+    int flags = fcntl(hot_reload.pipe_fds[0], F_GETFL, 0);
+    assert(flags != -1);
+    assert(-1 != fcntl(hot_reload.pipe_fds[0], F_SETFL, flags | O_NONBLOCK));
+    mcp_lvgl_poll_add(hot_reload.pipe_fds[0], hot_reload_poll_cb, EPOLLIN, NULL);
+
+    res = pthread_attr_init(&attr);
+    assert(res == 0);
+    res = pthread_attr_setstacksize(&attr, CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD_STACKSIZE);
+    assert(res == 0);
+    res = pthread_create(&hot_reload.thread, &attr, hot_reload_thread, NULL);
+    assert(res == 0);
+    res = pthread_attr_destroy(&attr);
+    assert(res == 0);
+}
+
+/* a reload compiled but not yet swapped in is dropped */
+static void hot_reload_stop(void)
+{
+    int res;
+    ssize_t rwres;
+
+    hot_reload.stop = true;
+    res = pthread_join(hot_reload.thread, NULL);
+    assert(res == 0);
+
+    reload_t * r;
+    while(sizeof(r) == (rwres = read(hot_reload.pipe_fds[0], &r, sizeof(r)))) {
+        mcp_forth_unload(&r->load);
+        free(r);
+    }
+
+    assert(0 == close(hot_reload.pipe_fds[0]));
+    assert(0 == close(hot_reload.pipe_fds[1]));
+}
+#endif
+
 static void mq_poll_cb(mcp_lvgl_poll_t * handle, int fd, uint32_t revents, void * user_data)
 {
     assert(revents == EPOLLIN);
@@ -546,6 +1344,8 @@ int mcp_lvgl_main(int argc, char *argv[])
         .forth_native = forth_native,
     };
 
+    lvgl_thread = pthread_self();
+
     driver_ll_t * drv_head = NULL;
 
     mqd_t mq = inner_open(O_RDONLY | O_CREAT);
@@ -583,6 +1383,10 @@ int mcp_lvgl_main(int argc, char *argv[])
     assert(-1 != fcntl(mq, F_SETFL, flags | O_NONBLOCK));
     mcp_lvgl_poll_add(mq, mq_poll_cb, EPOLLIN, &drv_head);
 
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    hot_reload_start(&drv_head, forth_native);
+#endif
+
     int keypad_fd = open("/dev/ukeyboard", O_RDONLY | O_NONBLOCK);
     assert(keypad_fd >= 0);
     keypad_poll_data_t keypad_poll_data;
@@ -591,11 +1395,25 @@ int mcp_lvgl_main(int argc, char *argv[])
 
     mcp_lvgl_poll_run_until_done();
 
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+    hot_reload_stop();
+#endif
+#if CONFIG_MCP_APPS_MCP_LVGL_WORKERS
+    work_pool_stop();
+#endif
     mcp_lvgl_poll_deinit();
     lv_deinit();
 
     do {
         unload_forth_driver(&drv_head->drv);
+#ifdef CONFIG_MCP_APPS_MCP_LVGL_HOT_RELOAD
+        if(drv_head->drv.reload) {
+            mcp_forth_unload(&drv_head->drv.reload->load);
+            free(drv_head->drv.reload);
+        }
+        free(drv_head->drv.path);
+        free(drv_head->drv.hash_path);
+#endif
         driver_ll_t * next = drv_head->next;
         lv_free(drv_head);
         drv_head = next;
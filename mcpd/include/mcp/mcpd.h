@@ -56,6 +56,8 @@ int mcpd_resource_route(mcpd_con_t con, unsigned resource_id, unsigned io_type,
 const char * mcpd_resource_get_path(mcpd_con_t con, unsigned resource_id);
 
 int mcpd_file_hash(mcpd_con_t con, const char * file_name, uint8_t * hash_32_byte_dst);
+int mcpd_file_generation(mcpd_con_t con, const char * file_name, uint8_t * uid_8_byte_dst,
+    uint32_t * generation_dst);
 
 #ifdef __cplusplus
 } /*extern "C"*/
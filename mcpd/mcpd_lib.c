@@ -466,3 +466,46 @@ int mcpd_file_hash(mcpd_con_t conp, const char * file_name, uint8_t * hash_32_by
 
     return 0;
 }
+
+/* The module reports an 8 byte id of its filesystem instance and a
+   generation number for the file which changes whenever the file does.
+   Together with the file name they identify the file's content without
+   the module having to hash the whole file. */
+int mcpd_file_generation(mcpd_con_t conp, const char * file_name, uint8_t * uid_8_byte_dst,
+    uint32_t * generation_dst)
+{
+    assert(conp->async_status == ASYNC_STATUS_OFF);
+
+    uint8_t byte;
+
+    size_t file_name_len = strlen(file_name);
+    if(file_name_len > 255) {
+        return MCPD_NAMETOOLONG;
+    }
+
+    byte = 3; /* generation protocol */
+    mcpd_write(conp, &byte, 1);
+    mcpd_read(conp, &byte, 1);
+    if(byte) {
+        return MCPD_PROTOCOL_NOT_SUP;
+    }
+
+    byte = file_name_len;
+    mcpd_write(conp, &byte, 1);
+    mcpd_write(conp, file_name, file_name_len);
+
+    mcpd_read(conp, &byte, 1);
+
+    switch(byte) {
+        case 0: break;
+        case 1: return MCPD_IOERROR;
+        case 3: return MCPD_NOENT;
+        case 4: return MCPD_NAMETOOLONG;
+        default: assert(0);
+    }
+
+    mcpd_read(conp, uid_8_byte_dst, 8);
+    mcpd_read(conp, generation_dst, 4);
+
+    return 0;
+}